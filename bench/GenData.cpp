@@ -0,0 +1,302 @@
+// 合成数据生成器：按给定的统计特征生成检索库和查询，输出为各版本程序的输入格式
+// 编译：g++ -O3 -std=c++11 bench/GenData.cpp -o gen_data
+// 运行：./gen_data --rows=100000 --cols=30109 --nnz-mean=127 --zipf=1.0 > data/base_small.txt
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <numeric>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+using namespace std;
+
+// 运行参数
+struct GenOptions {
+    int rows = 100000;          // 检索库向量数
+    int cols = 30109;           // 维度
+    int queries = 1000;         // 查询数
+    int topk = 10;
+    string nnz_dist = "lognormal";  // 每行非零元数的分布：fixed / uniform / lognormal
+    double nnz_mean = 127;      // fixed和lognormal的均值
+    double nnz_sigma = 0.5;     // lognormal的对数标准差
+    int nnz_min = 1;            // 每行非零元数的下限（uniform分布的取值范围）
+    int nnz_max = 1000;         // 每行非零元数的上限
+    double zipf = 1.0;          // 维度热度的Zipf指数，第r热的维度被选中的概率正比于 1/r^zipf，0为均匀
+    double neg_frac = 0.0;      // 取值为负的比例
+    uint32_t seed = 1;
+    string format = "csr";      // 输出格式：csr / rows / binary
+};
+
+bool parse_options(int argc, char** argv, GenOptions& opt) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        const char* eq = strchr(arg, '=');
+        if (!eq) {
+            cerr << "unknown option: " << arg << endl;
+            return false;
+        }
+        string name(arg, eq);
+        const char* value = eq + 1;
+        if (name == "--rows") {
+            opt.rows = atoi(value);
+        } else if (name == "--cols") {
+            opt.cols = atoi(value);
+        } else if (name == "--queries") {
+            opt.queries = atoi(value);
+        } else if (name == "--topk") {
+            opt.topk = atoi(value);
+        } else if (name == "--nnz-dist") {
+            opt.nnz_dist = value;
+        } else if (name == "--nnz-mean") {
+            opt.nnz_mean = atof(value);
+        } else if (name == "--nnz-sigma") {
+            opt.nnz_sigma = atof(value);
+        } else if (name == "--nnz-min") {
+            opt.nnz_min = atoi(value);
+        } else if (name == "--nnz-max") {
+            opt.nnz_max = atoi(value);
+        } else if (name == "--zipf") {
+            opt.zipf = atof(value);
+        } else if (name == "--neg-frac") {
+            opt.neg_frac = atof(value);
+        } else if (name == "--seed") {
+            opt.seed = (uint32_t)strtoul(value, nullptr, 10);
+        } else if (name == "--format") {
+            opt.format = value;
+        } else {
+            cerr << "unknown option: " << arg << endl;
+            return false;
+        }
+    }
+    if (opt.rows <= 0 || opt.cols <= 0 || opt.queries < 0 || opt.topk <= 0) {
+        cerr << "rows, cols and topk must be positive" << endl;
+        return false;
+    }
+    if (opt.nnz_dist != "fixed" && opt.nnz_dist != "uniform" && opt.nnz_dist != "lognormal") {
+        cerr << "unknown nnz distribution: " << opt.nnz_dist << endl;
+        return false;
+    }
+    if (opt.format != "csr" && opt.format != "rows" && opt.format != "binary") {
+        cerr << "unknown output format: " << opt.format << endl;
+        return false;
+    }
+    opt.nnz_min = max(1, opt.nnz_min);
+    opt.nnz_max = min(opt.cols, max(opt.nnz_min, opt.nnz_max));
+    if (opt.zipf < 0 || opt.neg_frac < 0 || opt.neg_frac > 1) {
+        cerr << "invalid zipf exponent or negative fraction" << endl;
+        return false;
+    }
+    return true;
+}
+
+// 向量生成器：非零元数按给定分布抽取，维度按Zipf热度不放回抽样
+class VectorGenerator {
+private:
+    const GenOptions& opt;
+    mt19937_64 gen;
+    vector<double> cdf;      // 按热度排名的累积概率
+    vector<int> rank_dim;    // 第r热的维度（随机打乱，热门维度不集中在低位）
+    vector<uint32_t> mark;   // 抽样去重标记
+    uint32_t epoch = 0;
+
+    int draw_nnz() {
+        double k = opt.nnz_mean;
+        if (opt.nnz_dist == "uniform") {
+            k = uniform_int_distribution<int>(opt.nnz_min, opt.nnz_max)(gen);
+        } else if (opt.nnz_dist == "lognormal") {
+            // 对数正态分布，mu取值使均值为nnz_mean
+            double mu = log(max(opt.nnz_mean, 1.0)) - opt.nnz_sigma * opt.nnz_sigma / 2;
+            k = lognormal_distribution<double>(mu, opt.nnz_sigma)(gen);
+        }
+        return min(opt.nnz_max, max(opt.nnz_min, (int)lround(k)));
+    }
+
+    int draw_rank() {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(gen);
+        int r = (int)(upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return min(r, opt.cols - 1);
+    }
+
+public:
+    VectorGenerator(const GenOptions& o, uint64_t seed) : opt(o), gen(seed), cdf(o.cols), rank_dim(o.cols), mark(o.cols, 0) {
+        double sum = 0.0;
+        for (int r = 0; r < opt.cols; ++r) {
+            sum += 1.0 / pow(r + 1.0, opt.zipf);
+            cdf[r] = sum;
+        }
+        for (double& c : cdf) c /= sum;
+        iota(rank_dim.begin(), rank_dim.end(), 0);
+        shuffle(rank_dim.begin(), rank_dim.end(), gen);
+    }
+
+    // 生成一个向量，维度升序，追加到indices/values末尾
+    void next(vector<int>& indices, vector<double>& values) {
+        int k = draw_nnz();
+        ++epoch;
+        size_t start = indices.size();
+        // 热门维度可能反复抽中，尝试次数用完后按热度顺序补齐
+        for (int attempt = 0; (int)(indices.size() - start) < k && attempt < 32 * k; ++attempt) {
+            int d = rank_dim[draw_rank()];
+            if (mark[d] == epoch) continue;
+            mark[d] = epoch;
+            indices.push_back(d);
+        }
+        for (int r = 0; (int)(indices.size() - start) < k; ++r) {
+            int d = rank_dim[r];
+            if (mark[d] == epoch) continue;
+            mark[d] = epoch;
+            indices.push_back(d);
+        }
+        sort(indices.begin() + start, indices.end());
+        uniform_real_distribution<double> value(0.0, 1.0);
+        for (int i = 0; i < k; ++i) {
+            double v = round(value(gen) * 1e4) / 1e4 + 1e-4;  // 保留4位小数，不为0
+            if (value(gen) < opt.neg_frac) v = -v;
+            values.push_back(v);
+        }
+    }
+};
+
+// 输出缓冲：文本和二进制都先写入缓冲区再整块fwrite
+class Writer {
+private:
+    FILE* file;
+    vector<char> buffer;
+    size_t len = 0;
+
+    void reserve(size_t n) {
+        if (len + n > buffer.size()) flush();
+    }
+
+public:
+    explicit Writer(FILE* f) : file(f), buffer(1 << 20) {}
+    ~Writer() { flush(); }
+
+    void flush() {
+        fwrite(buffer.data(), 1, len, file);
+        len = 0;
+    }
+
+    void bytes(const void* data, size_t n) {
+        const char* src = static_cast<const char*>(data);
+        while (n > 0) {
+            reserve(1);
+            size_t take = min(n, buffer.size() - len);
+            memcpy(buffer.data() + len, src, take);
+            len += take;
+            src += take;
+            n -= take;
+        }
+    }
+
+    template <class T>
+    void binary(T x) { bytes(&x, sizeof(T)); }
+
+    void text(long long x, char sep) {
+        reserve(32);
+        len += snprintf(buffer.data() + len, 32, "%lld%c", x, sep);
+    }
+
+    void text(int x, char sep) { text((long long)x, sep); }
+
+    void text(double x, char sep) {
+        reserve(32);
+        len += snprintf(buffer.data() + len, 32, "%.4f%c", x, sep);
+    }
+};
+
+// 一行文本：元素之间空格分隔，末尾换行
+template <class T>
+void write_line(Writer& out, const T* data, size_t n) {
+    if (n == 0) {
+        out.bytes("\n", 1);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) out.text(data[i], i + 1 < n ? ' ' : '\n');
+}
+
+// 逐行/查询格式的一个向量：文本为 nnz、维度、取值三行；二进制为 int32 nnz、int32 维度[nnz]、float64 取值[nnz]
+void write_row(Writer& out, bool binary, const int* indices, const double* values, int k) {
+    if (binary) {
+        out.binary<int32_t>(k);
+        out.bytes(indices, k * sizeof(int));
+        out.bytes(values, k * sizeof(double));
+        return;
+    }
+    out.text((long long)k, '\n');
+    write_line(out, indices, k);
+    write_line(out, values, k);
+}
+
+int main(int argc, char** argv) {
+    GenOptions opt;
+    if (!parse_options(argc, argv, opt)) return 1;
+
+    // 检索库和查询使用同一个热度分布，但随机数序列不同
+    VectorGenerator base_gen(opt, opt.seed);
+    vector<size_t> indptr(1, 0);
+    vector<int> indices;
+    vector<double> values;
+    for (int r = 0; r < opt.rows; ++r) {
+        base_gen.next(indices, values);
+        indptr.push_back(indices.size());
+    }
+    VectorGenerator query_gen(opt, (uint64_t)opt.seed * 0x9E3779B97F4A7C15ULL + 1);
+    vector<size_t> query_ptr(1, 0);
+    vector<int> query_indices;
+    vector<double> query_values;
+    for (int q = 0; q < opt.queries; ++q) {
+        query_gen.next(query_indices, query_values);
+        query_ptr.push_back(query_indices.size());
+    }
+
+    bool binary = opt.format == "binary";
+    size_t nnz = indices.size();
+    Writer out(stdout);
+    if (binary) {
+        out.bytes("LSHB", 4);
+        out.binary<int32_t>(opt.rows);
+        out.binary<int32_t>(opt.cols);
+        out.binary<int64_t>(nnz);
+        out.binary<int32_t>(opt.topk);
+    } else {
+        out.text((long long)opt.rows, ' ');
+        out.text((long long)opt.cols, ' ');
+        out.text((long long)nnz, ' ');
+        out.text((long long)opt.topk, '\n');
+    }
+    if (opt.format == "csr") {
+        vector<long long> ptr(indptr.begin(), indptr.end());
+        write_line(out, ptr.data(), ptr.size());
+        write_line(out, indices.data(), nnz);
+        write_line(out, values.data(), nnz);
+    } else {
+        for (int r = 0; r < opt.rows; ++r) {
+            write_row(out, binary, &indices[indptr[r]], &values[indptr[r]], (int)(indptr[r + 1] - indptr[r]));
+        }
+    }
+    if (binary) {
+        out.binary<int32_t>(opt.queries);
+    } else {
+        out.text((long long)opt.queries, '\n');
+    }
+    for (int q = 0; q < opt.queries; ++q) {
+        write_row(out, binary, &query_indices[query_ptr[q]], &query_values[query_ptr[q]],
+                  (int)(query_ptr[q + 1] - query_ptr[q]));
+    }
+    out.flush();
+
+    // 实际统计信息：平均非零元数和最热门1%维度占的非零元比例
+    vector<size_t> df(opt.cols, 0);
+    for (int d : indices) ++df[d];
+    sort(df.rbegin(), df.rend());
+    size_t head = 0;
+    for (int d = 0; d < max(1, opt.cols / 100); ++d) head += df[d];
+    fprintf(stderr, "rows %d, cols %d, nnz %zu (%.1f per row), top 1%% dims hold %.1f%% of nnz, queries %d\n",
+            opt.rows, opt.cols, nnz, (double)nnz / opt.rows, nnz ? 100.0 * head / nnz : 0.0, opt.queries);
+    return 0;
+}
@@ -0,0 +1,366 @@
+// 热点函数的微基准：每个函数单独计时，输出 ns/op、B/op（每次操作分配的堆内存字节数）和 allocs/op
+// 三个版本的源文件直接包含进来，各自放在独立的命名空间里，测的就是程序实际使用的代码
+// 编译：g++ -O3 -std=c++11 -pthread bench/KernelBench.cpp -o kernel_bench
+// 运行：./gen_data --rows=100000 | ./kernel_bench [--min-time=毫秒] [--filter=名称子串] [--sample=N]
+//
+// 被包含的源文件用到的标准头文件必须先在这里包含，否则会被展开进命名空间里
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <new>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// 统计堆分配：替换全局operator new，计时区间内的分配计入B/op和allocs/op
+static size_t alloc_bytes = 0;
+static size_t alloc_count = 0;
+
+void* operator new(std::size_t n) {
+    alloc_bytes += n;
+    ++alloc_count;
+    void* p = std::malloc(n ? n : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+// operator new/delete内联之后GCC会把这里的free看成释放new得到的内存而报警，实际两边都是malloc/free
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
+
+// 被包含的源文件里有大量int与size()的比较，这里不为它们报警
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#define main version_main
+namespace v1 {
+#include "../src/Main.cpp"
+const int hash_bits = number_hash;
+}
+#undef number_hash
+namespace v2 {
+#include "../src/Main3.cpp"
+const int hash_bits = number_hash;
+}
+#undef number_hash
+#undef bound_dims
+namespace v3 {
+#include "../src/Main4.cpp"
+const int hash_bits = NUMBER_HASH;
+}
+#undef NUMBER_HASH
+#undef main
+#pragma GCC diagnostic pop
+
+using namespace std;
+
+// 防止被测结果被优化掉
+static volatile double sink = 0;
+
+struct BenchOptions {
+    double min_time = 200;  // 每个基准至少运行的毫秒数
+    string filter;          // 只运行名称包含该子串的基准
+    int sample = 4096;      // 参与哈希计算、内积等基准的向量数
+};
+
+bool parse_options(int argc, char** argv, BenchOptions& opt) {
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--min-time=", 11) == 0) {
+            opt.min_time = atof(argv[i] + 11);
+            if (opt.min_time <= 0) {
+                cerr << "invalid time: " << argv[i] + 11 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            opt.filter = argv[i] + 9;
+        } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+            opt.sample = atoi(argv[i] + 9);
+            if (opt.sample <= 0) {
+                cerr << "invalid sample size: " << argv[i] + 9 << endl;
+                return false;
+            }
+        } else {
+            cerr << "unknown option: " << argv[i] << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// 运行一个基准：先预热一轮，之后反复执行 setup（不计时）和 run（计时），直到累计时间超过min_time
+// run返回本轮完成的操作数
+template <class Setup, class Run>
+void run_bench(const BenchOptions& opt, const string& name, Setup setup, Run run) {
+    if (name.find(opt.filter) == string::npos) return;
+    setup();
+    run();
+    double total_ns = 0;
+    size_t ops = 0, bytes = 0, count = 0;
+    while (total_ns < opt.min_time * 1e6) {
+        setup();
+        size_t bytes_before = alloc_bytes, count_before = alloc_count;
+        auto start = chrono::steady_clock::now();
+        ops += run();
+        auto stop = chrono::steady_clock::now();
+        bytes += alloc_bytes - bytes_before;
+        count += alloc_count - count_before;
+        total_ns += chrono::duration<double, nano>(stop - start).count();
+    }
+    printf("%-32s %12zu ops %12.1f ns/op %10.1f B/op %8.2f allocs/op\n", name.c_str(), ops,
+           total_ns / ops, (double)bytes / ops, (double)count / ops);
+    fflush(stdout);
+}
+
+template <class Run>
+void run_bench(const BenchOptions& opt, const string& name, Run run) {
+    run_bench(opt, name, [] {}, run);
+}
+
+// 从标准输入读取的数据集：CSR检索库和查询，维度已按升序排列
+struct Dataset {
+    int row = 0, col = 0, topk = 0;
+    vector<size_t> indptr;
+    vector<int> indices;
+    vector<double> values;
+    vector<v2::SparseVector> queries;
+};
+
+bool load_dataset(Dataset& data) {
+    v2::InputReader in(stdin);
+    size_t nnz;
+    if (!v2::read_header(in, v2::INPUT_CSR, data.row, data.col, nnz, data.topk)) return false;
+    data.indptr.resize(data.row + 1);
+    data.indices.resize(nnz);
+    data.values.resize(nnz);
+    for (auto& x : data.indptr) {
+        if (!in.read_int(x)) return false;
+    }
+    for (auto& x : data.indices) {
+        if (!in.read_int(x)) return false;
+    }
+    for (auto& x : data.values) {
+        if (!in.read_double(x)) return false;
+    }
+    int nq;
+    if (!in.read_int(nq) || nq <= 0) return false;
+    data.queries.resize(nq);
+    for (auto& q : data.queries) {
+        if (!v2::read_row(in, v2::INPUT_ROWS, q.indices, q.values)) return false;
+        q.sort_indices();
+    }
+    return true;
+}
+
+// 把第i行复制进各版本自己的稀疏向量类型
+template <class Vec>
+void copy_row(const Dataset& data, int i, Vec& vec) {
+    vec.indices.assign(data.indices.begin() + data.indptr[i], data.indices.begin() + data.indptr[i + 1]);
+    vec.values.assign(data.values.begin() + data.indptr[i], data.values.begin() + data.indptr[i + 1]);
+    vector<size_t> order(vec.indices.size());
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](size_t a, size_t b) { return vec.indices[a] < vec.indices[b]; });
+    Vec sorted = vec;
+    for (size_t j = 0; j < order.size(); ++j) {
+        sorted.indices[j] = vec.indices[order[j]];
+        sorted.values[j] = vec.values[order[j]];
+    }
+    vec = sorted;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opt;
+    if (!parse_options(argc, argv, opt)) return 1;
+    Dataset data;
+    if (!load_dataset(data)) {
+        cerr << "invalid input" << endl;
+        return 1;
+    }
+    int row = data.row, col = data.col, topk = data.topk;
+    int sample = min(opt.sample, row);
+    int nq = (int)data.queries.size();
+    size_t nnz = data.indices.size();
+    printf("rows %d, cols %d, nnz %zu, queries %d, sample %d\n", row, col, nnz, nq, sample);
+
+    // 各版本的向量、投影矩阵和索引
+    vector<v1::SparseVector> base1(sample);
+    vector<v3::SparseVector> base3(row);
+    for (int i = 0; i < row; ++i) {
+        if (i < sample) copy_row(data, i, base1[i]);
+        copy_row(data, i, base3[i]);
+    }
+    vector<v3::SparseVector> queries3(nq);
+    for (int q = 0; q < nq; ++q) {
+        queries3[q].indices = data.queries[q].indices;
+        queries3[q].values = data.queries[q].values;
+    }
+    vector<vector<double>> proj1 = v1::generate_random_vectors(v1::hash_bits, col);
+    vector<vector<double>> proj3 = v3::generate_random_vectors(v3::hash_bits, col);
+
+    v2::LSHIndex index;
+    index.row = row;
+    index.col = col;
+    index.num_tables = 5;
+    for (int t = 0; t < index.num_tables; ++t) index.hash_tables.emplace_back(1 << v2::hash_bits);
+    index.base.indptr = data.indptr;
+    index.base.indices = data.indices;
+    index.base.values = data.values;
+    index.base.sort_rows();
+    v2::init_projections(index);
+
+    // Main4的哈希函数需要稠密向量，只对少量向量展开
+    int dense_count = min(sample, max(1, (int)((64 << 20) / ((size_t)col * sizeof(double)))));
+    vector<vector<double>> dense3(dense_count, vector<double>(col, 0.0));
+    for (int i = 0; i < dense_count; ++i) {
+        for (size_t j = 0; j < base3[i].indices.size(); ++j) dense3[i][base3[i].indices[j]] = base3[i].values[j];
+    }
+
+    // 插入/查找用的哈希键：所有向量在第一张表上的哈希码
+    // v3的键与v2一样是12位SRP码，直接用v2的码（v3需要稠密向量，全部展开太大）
+    vector<uint32_t> codes2(row);
+    vector<uint32_t> code_buf(index.num_tables);
+    vector<double> acc_buf(index.num_tables * v2::hash_bits);
+    for (int i = 0; i < row; ++i) {
+        v2::compute_codes(index, index.base.row(i).indices, index.base.row(i).values, index.base.row(i).nnz,
+                          code_buf.data(), acc_buf.data());
+        codes2[i] = code_buf[0];
+    }
+    vector<uint32_t> qcodes2(nq);
+    for (int q = 0; q < nq; ++q) {
+        v2::compute_codes(index, data.queries[q].indices.data(), data.queries[q].values.data(),
+                          data.queries[q].indices.size(), code_buf.data(), acc_buf.data());
+        qcodes2[q] = code_buf[0];
+    }
+
+    // 哈希计算：一次操作为一个向量在一张表上的哈希码（compute_codes为一个向量在所有表上的哈希码，
+    // Main3只用这一个版本）
+    run_bench(opt, "compute_hash/v1 (8 bits)", [&] {
+        for (int i = 0; i < sample; ++i) sink = sink + v1::compute_hash(base1[i], proj1)[0];
+        return (size_t)sample;
+    });
+    run_bench(opt, "compute_codes/v2 (5x12 bits)", [&] {
+        for (int i = 0; i < sample; ++i) {
+            v2::SparseRow r = index.base.row(i);
+            v2::compute_codes(index, r.indices, r.values, r.nnz, code_buf.data(), acc_buf.data());
+            sink = sink + code_buf[0];
+        }
+        return (size_t)sample;
+    });
+    run_bench(opt, "compute_hash/v3 (12 bits, dense)", [&] {
+        for (int i = 0; i < dense_count; ++i) sink = sink + v3::compute_hash(dense3[i], proj3)[0];
+        return (size_t)dense_count;
+    });
+
+    // 哈希码转整数键
+    vector<vector<bool>> bits3(dense_count);
+    for (int i = 0; i < dense_count; ++i) bits3[i] = v3::compute_hash(dense3[i], proj3);
+    run_bench(opt, "bool_vector_to_int/v3", [&] {
+        size_t n = 0;
+        for (int r = 0; r < 64; ++r) {
+            for (int i = 0; i < dense_count; ++i) sink = sink + v3::bool_vector_to_int(bits3[i]);
+            n += dense_count;
+        }
+        return n;
+    });
+
+    // 稀疏内积：查询与检索库向量的双指针内积
+    run_bench(opt, "sparse_inner_product/v2", [&] {
+        double sum = 0;
+        for (int i = 0; i < sample; ++i) sum += v2::sparse_inner_product(data.queries[i % nq], index.base.row(i));
+        sink = sink + sum;
+        return (size_t)sample;
+    });
+    run_bench(opt, "sparse_inner_product/v3", [&] {
+        double sum = 0;
+        for (int i = 0; i < sample; ++i) sum += v3::sparse_inner_product(queries3[i % nq], base3[i]);
+        sink = sink + sum;
+        return (size_t)sample;
+    });
+
+    // 哈希表插入：一次操作为插入一个向量id，每轮建一张新表（建表不计时）
+    // v1的哈希表构造时把所有槽位都标成占用，insert什么也存不进去、find总是查不到，计时没有意义，不参与比较
+    unique_ptr<v2::MyHashTable> table2;
+    unique_ptr<v3::FastHashTable> table3;
+    run_bench(opt, "insert/v2",
+              [&] { table2.reset(new v2::MyHashTable(1 << v2::hash_bits)); },
+              [&] {
+                  for (int i = 0; i < row; ++i) table2->insert(codes2[i], i);
+                  return (size_t)row;
+              });
+    run_bench(opt, "insert/v3",
+              [&] { table3.reset(new v3::FastHashTable(1 << 20)); },
+              [&] {
+                  for (int i = 0; i < row; ++i) table3->insert(codes2[i], i);
+                  return (size_t)row;
+              });
+
+    // 哈希表查找：一次操作为查找一个查询的哈希码并遍历返回的id
+    table2.reset(new v2::MyHashTable(1 << v2::hash_bits));
+    table3.reset(new v3::FastHashTable(1 << 20));
+    for (int i = 0; i < row; ++i) {
+        table2->insert(codes2[i], i);
+        table3->insert(codes2[i], i);
+    }
+    table2->freeze();
+    run_bench(opt, "find/v2", [&] {
+        size_t n = 0;
+        for (int q = 0; q < nq; ++q) n += table2->find(qcodes2[q]).count;
+        sink = sink + n;
+        return (size_t)nq;
+    });
+    run_bench(opt, "find/v3", [&] {
+        size_t n = 0;
+        for (int q = 0; q < nq; ++q) n += table3->find(qcodes2[q]).size();
+        sink = sink + n;
+        return (size_t)nq;
+    });
+
+    // top-k选择：一次操作为从sample个得分中选出topk个（包含把得分复制到工作数组）
+    vector<pair<double, int>> scores(sample), work;
+    for (int i = 0; i < sample; ++i) scores[i] = make_pair(v2::sparse_inner_product(data.queries[0], index.base.row(i)), i);
+    work.reserve(sample);
+    v2::SearchResult result;
+    auto better = [](const pair<double, int>& a, const pair<double, int>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    run_bench(opt, "nth_element/v3", [&] {
+        work.assign(scores.begin(), scores.end());
+        nth_element(work.begin(), work.begin() + min(topk, sample), work.end(), better);
+        sink = sink + work[0].first;
+        return (size_t)1;
+    });
+    run_bench(opt, "select_topk/v2", [&] {
+        work.assign(scores.begin(), scores.end());
+        v2::select_topk(work, topk, result);
+        sink = sink + result.scores.size();
+        return (size_t)1;
+    });
+    run_bench(opt, "sort/v1", [&] {
+        work.assign(scores.begin(), scores.end());
+        sort(work.begin(), work.end(), better);
+        sink = sink + work[0].first;
+        return (size_t)1;
+    });
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include <numeric>
 #include<string>
 #include<cstdint>
+#include<cstdio>
 using namespace std;
 #define number_hash  8
 
@@ -284,19 +285,20 @@ for (int i = 0; i < num_tables; ++i) {
    int nq;
 cin >> nq;
 
-vector<Query> queries(nq);
-// 读取所有查询数据
+// 输出缓冲：结果先攒在out_buf中，攒满后一次fwrite，不再每个查询endl刷新一次
+string out_buf;
+out_buf.reserve(1 << 20);
+
+// 逐条读取并处理查询，不再把所有查询先读进内存
+Query query;
 for (int q = 0; q < nq; q++) {
     int q_nnz;
     cin >> q_nnz;  // 当前查询的非零项数量
-    queries[q].ids.resize(q_nnz);
-    queries[q].vals.resize(q_nnz);
-    for (int i = 0; i < q_nnz; i++) cin >> queries[q].ids[i];   // 读ID
-    for (int i = 0; i < q_nnz; i++) cin >> queries[q].vals[i];  // 读对应值
-}
+    query.ids.resize(q_nnz);
+    query.vals.resize(q_nnz);
+    for (int i = 0; i < q_nnz; i++) cin >> query.ids[i];   // 读ID
+    for (int i = 0; i < q_nnz; i++) cin >> query.vals[i];  // 读对应值
 
-// 处理每个查询
-for (const auto& query : queries) {
     // 构建稀疏查询向量
     SparseVector query_vec;
     query_vec.indices = query.ids;
@@ -377,12 +379,18 @@ sort(scores.begin(), scores.end(), [](const pair<double, int>& a, const pair<dou
 // 输出topk个
 int output_k = min(topk, (int)scores.size());
 for (int i = 0; i < output_k; ++i) {
-    cout << scores[i].second;
-    if (i < output_k - 1) cout << " ";
+    out_buf += to_string(scores[i].second);
+    if (i < output_k - 1) out_buf += ' ';
 }
-cout << endl;
-
+out_buf += '\n';
+if (out_buf.size() >= (1 << 20)) {
+    fwrite(out_buf.data(), 1, out_buf.size(), stdout);
+    out_buf.clear();
 }
 
+}
+fwrite(out_buf.data(), 1, out_buf.size(), stdout);
+fflush(stdout);
+return 0;
 
 }    
@@ -2,91 +2,235 @@
 #include <vector>
 #include <algorithm>
 #include <unordered_map>  
-#include <unordered_set>
 #include <random>
 #include <numeric>
 #include <string>
 #include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <memory>
+#include <cstdio>
+#include <cctype>
+#include <cmath>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#endif
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 using namespace std;
 #define number_hash 12  // 增加哈希位数提高区分度
 
-// 查询结构体
-struct Query {
-    vector<int> ids;
-    vector<double> vals;
+// 区域分配器：按大块申请内存，块内顺序分配，不单独释放
+// 索引的节点用它分配，生命周期与索引相同；查询的临时数据用它分配，每次查询reset后复用同一批块
+class Arena {
+private:
+    vector<unique_ptr<char[]>> blocks;
+    vector<size_t> sizes;
+    size_t block_size;
+    size_t current = 0;  // 正在分配的块
+    size_t offset = 0;   // 当前块已用字节数
+
+public:
+    explicit Arena(size_t block = 1 << 20) : block_size(block) {}
+
+    void* allocate(size_t bytes, size_t align) {
+        while (current < blocks.size()) {
+            size_t start = (offset + align - 1) & ~(align - 1);
+            if (start + bytes <= sizes[current]) {
+                offset = start + bytes;
+                return blocks[current].get() + start;
+            }
+            ++current;
+            offset = 0;
+        }
+        size_t size = max(block_size, bytes + align);
+        blocks.emplace_back(new char[size]);
+        sizes.push_back(size);
+        size_t start = ((size_t)(-(uintptr_t)blocks.back().get())) & (align - 1);
+        offset = start + bytes;
+        return blocks.back().get() + start;
+    }
+
+    // 只能存放平凡析构的类型
+    template <class T>
+    T* alloc(size_t n) {
+        return static_cast<T*>(allocate(n * sizeof(T), alignof(T)));
+    }
+
+    // 保留已申请的块，从头开始分配
+    void reset() {
+        current = 0;
+        offset = 0;
+    }
+
+    // 归还所有块
+    void release() {
+        blocks.clear();
+        sizes.clear();
+        reset();
+    }
+
+    size_t bytes_reserved() const {
+        size_t total = 0;
+        for (size_t s : sizes) total += s;
+        return total;
+    }
+};
+
+// 桶的摘要信息，用来估计查询与桶内任意向量内积的上界
+// 记录桶内出现过的每个维度（升序）上所有向量的最大值和最小值（缺失视为0，所以最大值不小于0、最小值不大于0），
+// 量化成step的整数倍并向外取整：hi[i]*step 不小于最大值，lo[i]*step 不小于最小值的绝对值
+// 查询与桶内任意向量的内积不超过 Σ_{q_d>0} q_d*hi*step + Σ_{q_d<0} |q_d|*lo*step
+struct BucketBound {
+    int num_dims;
+    double step;
+    const int* dims;
+    const uint8_t* hi;
+    const uint8_t* lo;
+};
+
+// 桶内id列表（指向哈希表内部的连续数组）；bound在构建时计算了摘要才有值
+struct IdList {
+    const int* ids;
+    int count;
+    const BucketBound* bound;
+    const int* begin() const { return ids; }
+    const int* end() const { return ids + count; }
 };
 
-// 哈希表节点结构（改为链表法）
+// 哈希表节点结构（链表法）；key为整数哈希码，节点和id数组放在区域分配器中，节点本身不再单独new
 struct HashNode {
-    string key;
-    vector<int> ids;
+    uint32_t key;
+    int* ids;
+    int count;
+    int capacity;
+    BucketBound* bound;
     HashNode* next;
-    HashNode(string k, int id) : key(k), next(nullptr) {
-        ids.push_back(id);
-    }
 };
 
-// 哈希表类（改为链表法实现）
+// 哈希表类（链表法实现）
+// 构建时桶内id数组在build_arena中倍增；freeze()后所有桶的id按桶顺序紧凑存放在arena中，build_arena释放
 class MyHashTable {
 private:
     vector<HashNode*> buckets;
     size_t capacity;
+    size_t total_ids = 0;
+    size_t num_nodes = 0;
+    Arena arena;
+    Arena build_arena;
 
-    // FNV-1a哈希函数
-    size_t hash_func(const string& key) const {
+    // FNV-1a哈希函数（按字节处理整数哈希码）
+    size_t hash_func(uint32_t key) const {
         const uint32_t FNV_prime = 16777619;
         uint32_t hash = 2166136261;
-        for (char c : key) {
-            hash ^= c;
+        for (int i = 0; i < 4; ++i) {
+            hash ^= (key >> (i * 8)) & 0xff;
             hash *= FNV_prime;
         }
         return hash % capacity;
     }
 
 public:
-    MyHashTable(size_t size) : capacity(size) {
+    MyHashTable(size_t size) : capacity(size), arena(64 << 10), build_arena(64 << 10) {
         buckets.resize(capacity, nullptr);
     }
 
-    ~MyHashTable() {
-        for (auto& head : buckets) {
-            while (head) {
-                HashNode* temp = head;
-                head = head->next;
-                delete temp;
-            }
-        }
-    }
-
-    void insert(const string& key, int id) {
+    void insert(uint32_t key, int id) {
         size_t index = hash_func(key);
         HashNode* current = buckets[index];
         
         // 检查是否已存在该key
         while (current) {
             if (current->key == key) {
-                current->ids.push_back(id);
-                return;
+                break;
             }
             current = current->next;
         }
         
         // 新建节点并插入链表头部
-        HashNode* newNode = new HashNode(key, id);
-        newNode->next = buckets[index];
-        buckets[index] = newNode;
+        if (!current) {
+            current = arena.alloc<HashNode>(1);
+            current->key = key;
+            current->ids = nullptr;
+            current->count = current->capacity = 0;
+            current->bound = nullptr;
+            current->next = buckets[index];
+            buckets[index] = current;
+            ++num_nodes;
+        }
+        if (current->count == current->capacity) {
+            int new_capacity = max(4, current->capacity * 2);
+            int* grown = build_arena.alloc<int>(new_capacity);
+            if (current->count) memcpy(grown, current->ids, current->count * sizeof(int));
+            current->ids = grown;
+            current->capacity = new_capacity;
+        }
+        current->ids[current->count++] = id;
+        ++total_ids;
     }
 
-    vector<int> find(const string& key) {
+    // 构建完成后把所有桶的id紧凑到一个数组中
+    void freeze() {
+        int* all = arena.alloc<int>(total_ids);
+        size_t offset = 0;
+        for (HashNode* head : buckets) {
+            for (HashNode* node = head; node; node = node->next) {
+                memcpy(all + offset, node->ids, node->count * sizeof(int));
+                node->ids = all + offset;
+                node->capacity = node->count;
+                offset += node->count;
+            }
+        }
+        build_arena.release();
+    }
+
+    // 为每个桶计算摘要：compute(ids, count, bound, arena)，摘要中的数组也从arena分配
+    template <class F>
+    void attach_bounds(F compute) {
+        for (HashNode* head : buckets) {
+            for (HashNode* node = head; node; node = node->next) {
+                node->bound = arena.alloc<BucketBound>(1);
+                compute(node->ids, node->count, *node->bound, arena);
+            }
+        }
+    }
+
+    // 遍历所有非空桶
+    template <class F>
+    void for_each_bucket(F visit) const {
+        for (HashNode* head : buckets) {
+            for (HashNode* node = head; node; node = node->next) {
+                visit(IdList{node->ids, node->count, node->bound});
+            }
+        }
+    }
+
+    size_t num_buckets() const { return num_nodes; }
+
+    IdList find(uint32_t key) const {
         size_t index = hash_func(key);
         HashNode* current = buckets[index];
         while (current) {
             if (current->key == key) {
-                return current->ids;
+                return IdList{current->ids, current->count, current->bound};
             }
             current = current->next;
         }
-        return {};
+        return IdList{nullptr, 0, nullptr};
+    }
+
+    size_t memory_bytes() const {
+        return buckets.capacity() * sizeof(HashNode*) + arena.bytes_reserved() + build_arena.bytes_reserved();
+    }
+
+    // 冻结后的实际占用：桶数组 + 节点 + id数组
+    static size_t estimate_bytes(size_t num_buckets, size_t num_nodes, size_t num_ids) {
+        return num_buckets * sizeof(HashNode*) + num_nodes * sizeof(HashNode) + num_ids * sizeof(int);
     }
 };
 
@@ -95,9 +239,10 @@ struct SparseVector {
     vector<int> indices;
     vector<double> values;
     
-    // 确保indices是有序的（双指针算法前提）
-    void sort_indices() {
-        vector<pair<int, double>> paired;
+    // 确保indices是有序的（双指针算法前提）；paired为调用方复用的排序缓冲区
+    void sort_indices(vector<pair<int, double>>& paired) {
+        if (is_sorted(indices.begin(), indices.end())) return;
+        paired.clear();
         for (size_t i = 0; i < indices.size(); ++i) {
             paired.emplace_back(indices[i], values[i]);
         }
@@ -111,6 +256,64 @@ struct SparseVector {
     }
 };
 
+// 稀疏行视图：指向CSR存储中的一行
+struct SparseRow {
+    const int* indices;
+    const double* values;
+    int nnz;
+};
+
+// 检索库的CSR存储：所有向量的非零元连续存放，同一行的数据在内存中相邻
+struct CSRStore {
+    vector<size_t> indptr;
+    vector<int> indices;
+    vector<double> values;
+
+    int size() const { return (int)indptr.size() - 1; }
+
+    SparseRow row(int i) const {
+        SparseRow r;
+        r.indices = indices.data() + indptr[i];
+        r.values = values.data() + indptr[i];
+        r.nnz = (int)(indptr[i + 1] - indptr[i]);
+        return r;
+    }
+
+    // 第i行按维度排序（双指针算法前提），排序规则与SparseVector::sort_indices一致；paired为复用的排序缓冲区
+    void sort_row(int i, vector<pair<int, double>>& paired) {
+        paired.clear();
+        for (size_t j = indptr[i]; j < indptr[i + 1]; ++j) {
+            paired.emplace_back(indices[j], values[j]);
+        }
+        sort(paired.begin(), paired.end());
+        for (size_t j = 0; j < paired.size(); ++j) {
+            indices[indptr[i] + j] = paired[j].first;
+            values[indptr[i] + j] = paired[j].second;
+        }
+    }
+
+    void sort_rows() {
+        vector<pair<int, double>> paired;
+        for (int i = 0; i < size(); ++i) sort_row(i, paired);
+    }
+
+    // 按order重新排列各行：新的第i行为原来的第order[i]行
+    void permute(const vector<int>& order) {
+        vector<size_t> new_indptr(indptr.size(), 0);
+        vector<int> new_indices(indices.size());
+        vector<double> new_values(values.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            size_t from = indptr[order[i]], len = indptr[order[i] + 1] - from;
+            copy(indices.begin() + from, indices.begin() + from + len, new_indices.begin() + new_indptr[i]);
+            copy(values.begin() + from, values.begin() + from + len, new_values.begin() + new_indptr[i]);
+            new_indptr[i + 1] = new_indptr[i] + len;
+        }
+        indptr.swap(new_indptr);
+        indices.swap(new_indices);
+        values.swap(new_values);
+    }
+};
+
 // 生成随机投影向量
 vector<vector<double>> generate_random_vectors(int num_hashes, int dim, unsigned int seed) {
     vector<uint32_t> seed_data{seed};
@@ -127,25 +330,11 @@ vector<vector<double>> generate_random_vectors(int num_hashes, int dim, unsigned
     return projections;
 }
 
-// 计算哈希码
-vector<bool> compute_hash(const SparseVector& vec, const vector<vector<double>>& projections) {
-    vector<bool> hash_code(number_hash, false);
-    for (int i = 0; i < number_hash; ++i) {
-        double dot = 0.0;
-        for (int j = 0; j < vec.indices.size(); ++j) {
-            int dim = vec.indices[j];
-            dot += vec.values[j] * projections[i][dim];
-        }
-        hash_code[i] = (dot >= 0);
-    }
-    return hash_code;
-}
-
 // 稀疏向量内积计算（双指针算法）
-double sparse_inner_product(const SparseVector& v1, const SparseVector& v2) {
+double sparse_inner_product(const SparseVector& v1, const SparseRow& v2) {
     double result = 0.0;
     int i = 0, j = 0;
-    while (i < v1.indices.size() && j < v2.indices.size()) {
+    while (i < v1.indices.size() && j < v2.nnz) {
         if (v1.indices[i] == v2.indices[j]) {
             result += v1.values[i] * v2.values[j];
             i++;
@@ -159,117 +348,1860 @@ double sparse_inner_product(const SparseVector& v1, const SparseVector& v2) {
     return result;
 }
 
-int main() {
-    ios::sync_with_stdio(false);
-    cin.tie(nullptr);
 
-    int row, col, nnz, topk;
-    cin >> row >> col >> nnz >> topk;
-    int num_tables = 5;  // 增加哈希表数量提高召回率
+// 探测方式
+enum ProbeMode {
+    PROBE_FIXED,   // 原始桶+翻转1位的邻近桶，候选数达到2*topk即停止
+    PROBE_BOUND,   // 按桶内积上界剪枝
+    PROBE_SKETCH   // 线性扫描所有向量的多表签名，按Hamming距离取候选
+};
 
-    vector<MyHashTable> hash_tables(num_tables, MyHashTable(1 << number_hash));
-    vector<vector<vector<double>>> all_projections(num_tables);
-    for (unsigned int i = 0; i < num_tables; ++i) {
-        all_projections[i] = generate_random_vectors(number_hash, col, i);
+// 运行参数
+struct Options {
+    bool batch = false;      // 批量查询模式
+    int batch_size = 32;     // 每个查询块的大小
+    bool reorder = false;    // 按第一张表的哈希码重排向量id
+    int cache_size = 0;      // 查询缓存条目数，0表示不启用
+    size_t mem_budget = 0;   // 内存预算（字节），0表示不限制
+    bool mem_report = false; // 构建后输出各数据结构的内存占用
+    string input = "csr";    // 输入格式：csr / rows / binary
+    bool binary_output = false; // 以二进制输出id和得分
+    int chunk_rows = 4096;   // 流水线构建时读取线程每读完多少行通知一次
+    ProbeMode probe = PROBE_FIXED;
+    int max_probes = 0;         // 上界探测模式下每个查询最多探测的桶数，0表示探测序列中的所有桶
+    double bound_scale = 1.0;   // 上界乘以该系数后仍不超过第k名得分的桶跳过，小于1时剪枝更激进
+    int sketch_candidates = 0;  // 签名扫描模式下精确计分的候选数，0表示 20*topk
+    bool filtered = false;      // 每个查询前带有过滤条件（阈值和允许的id）
+};
+
+bool parse_options(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--reorder") == 0) {
+            opt.reorder = true;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            opt.batch = true;
+        } else if (strcmp(argv[i], "--filtered") == 0) {
+            opt.filtered = true;
+        } else if (strcmp(argv[i], "--mem-report") == 0) {
+            opt.mem_report = true;
+        } else if (strncmp(argv[i], "--mem-budget=", 13) == 0) {
+            // 单位MB
+            double mb = atof(argv[i] + 13);
+            if (mb <= 0) {
+                cerr << "invalid memory budget: " << argv[i] + 13 << endl;
+                return false;
+            }
+            opt.mem_budget = (size_t)(mb * (1 << 20));
+        } else if (strcmp(argv[i], "--output=text") == 0) {
+            opt.binary_output = false;
+        } else if (strcmp(argv[i], "--output=binary") == 0) {
+            opt.binary_output = true;
+        } else if (strcmp(argv[i], "--probe=fixed") == 0) {
+            opt.probe = PROBE_FIXED;
+        } else if (strcmp(argv[i], "--probe=bound") == 0) {
+            opt.probe = PROBE_BOUND;
+        } else if (strcmp(argv[i], "--probe=sketch") == 0) {
+            opt.probe = PROBE_SKETCH;
+        } else if (strncmp(argv[i], "--sketch-candidates=", 20) == 0) {
+            opt.sketch_candidates = atoi(argv[i] + 20);
+            if (opt.sketch_candidates <= 0) {
+                cerr << "invalid candidate count: " << argv[i] + 20 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--max-probes=", 13) == 0) {
+            opt.max_probes = atoi(argv[i] + 13);
+            if (opt.max_probes <= 0) {
+                cerr << "invalid probe count: " << argv[i] + 13 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--bound-scale=", 14) == 0) {
+            opt.bound_scale = atof(argv[i] + 14);
+            if (opt.bound_scale <= 0) {
+                cerr << "invalid bound scale: " << argv[i] + 14 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--input=", 8) == 0) {
+            opt.input = argv[i] + 8;
+            if (opt.input != "csr" && opt.input != "rows" && opt.input != "binary") {
+                cerr << "unknown input format: " << opt.input << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--chunk=", 8) == 0) {
+            opt.chunk_rows = atoi(argv[i] + 8);
+            if (opt.chunk_rows <= 0) {
+                cerr << "invalid chunk size: " << argv[i] + 8 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--cache=", 8) == 0) {
+            opt.cache_size = atoi(argv[i] + 8);
+            if (opt.cache_size < 0) {
+                cerr << "invalid cache size: " << argv[i] + 8 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            opt.batch = true;
+            opt.batch_size = atoi(argv[i] + 8);
+            if (opt.batch_size <= 0) {
+                cerr << "invalid batch size: " << argv[i] + 8 << endl;
+                return false;
+            }
+        } else {
+            cerr << "unknown option: " << argv[i] << endl;
+            return false;
+        }
     }
+    if (opt.probe != PROBE_FIXED && opt.batch) {
+        cerr << "--batch only supports --probe=fixed" << endl;
+        return false;
+    }
+    return true;
+}
 
-    // 读取稀疏矩阵数据
-    vector<int> indptr(row + 1);
-    for (int i = 0; i <= row; i++) cin >> indptr[i];
-    
-    vector<int> indices(nnz);
-    for (int i = 0; i < nnz; i++) cin >> indices[i];
-    
-    vector<double> data(nnz);
-    for (int i = 0; i < nnz; i++) cin >> data[i];
+// LSH索引：稀疏向量 + 投影矩阵 + 多张哈希表
+// 内部id为向量在base中的行号；重排后通过external_ids映射回输入中的原始id
+struct LSHIndex {
+    int row = 0, col = 0, num_tables = 0;
+    uint64_t version = 0;  // 每次构建索引加一，查询缓存据此失效
+    CSRStore base;
+    vector<int> external_ids;
+    vector<int> internal_ids;  // external_ids的逆映射
+    // 转置后的投影矩阵：[dim][table * number_hash + bit]，所有表的投影按维度连续存放
+    vector<double> projections_t;
+    vector<MyHashTable> hash_tables;
+    bool bucket_bounds = false;  // 构建时是否计算桶摘要（上界剪枝探测需要）
+    bool sketch_store = false;   // 构建时是否保存每个向量的多表签名（签名扫描需要）
+    vector<uint64_t> sketches;   // 按内部id存放的多表签名
+};
+
+// 生成所有表的投影向量并转置；每张表的投影向量转置后即释放，只保留转置后的矩阵
+void init_projections(LSHIndex& index) {
+    int width = index.num_tables * number_hash;
+    index.projections_t.assign((size_t)index.col * width, 0.0);
+    for (int t = 0; t < index.num_tables; ++t) {
+        vector<vector<double>> projections = generate_random_vectors(number_hash, index.col, t);
+        for (int b = 0; b < number_hash; ++b) {
+            for (int d = 0; d < index.col; ++d) {
+                index.projections_t[(size_t)d * width + t * number_hash + b] = projections[b][d];
+            }
+        }
+    }
+}
+
+// 投影值转成各表的哈希码：第t张表的第b位为 acc[t * number_hash + b] >= 0
+void codes_from_projections(int num_tables, const double* acc, uint32_t* out) {
+    for (int t = 0; t < num_tables; ++t) {
+        out[t] = 0;
+        for (int b = 0; b < number_hash; ++b) {
+            if (acc[t * number_hash + b] >= 0) out[t] |= (1u << b);
+        }
+    }
+}
+
+// 计算一个向量在所有表的哈希码：稀疏向量 × 转置投影矩阵(稠密)
+// 每个非零元只读取一段连续的投影行，一次得到所有表的哈希码；累加顺序与逐个投影向量按非零元顺序求点积相同
+// acc为调用方提供的num_tables*number_hash个double的缓冲区
+void compute_codes(const LSHIndex& index, const int* indices, const double* values, size_t nnz,
+                   uint32_t* out, double* acc) {
+    int width = index.num_tables * number_hash;
+    fill(acc, acc + width, 0.0);
+    for (size_t j = 0; j < nnz; ++j) {
+        const double* proj = &index.projections_t[(size_t)indices[j] * width];
+        double v = values[j];
+        for (int h = 0; h < width; ++h) {
+            acc[h] += v * proj[h];
+        }
+    }
+    codes_from_projections(index.num_tables, acc, out);
+}
+
+// 稀疏查询块：块内所有查询的非零元按维度归并，块内出现过的每个维度占稠密矩阵的一行
+// slot[d]为维度d所在的行，没有出现的维度指向全零的第0行，计分时按向量的非零元直接取行，不需要判断
+// 块内不同维度通常只有几千个，整个矩阵能留在缓存里；不再为每个查询块展开 [col][块大小] 的稠密矩阵
+struct QueryBlock {
+    struct Entry {
+        int dim;
+        int lane;  // 块内查询号
+        int pos;   // 在查询中的位置
+        double value;
+    };
+    int lanes = 0;
+    vector<Entry> entries;  // 按(维度, 查询, 位置)排序
+    vector<int> dims;       // 第r行对应的维度为dims[r - 1]
+    vector<int> slot;
+    vector<double> values;  // [行][块内查询]
+
+    // 查询须已按维度排序
+    void load(const vector<const SparseVector*>& queries, int col) {
+        lanes = (int)queries.size();
+        if ((int)slot.size() < col) slot.assign(col, 0);
+        entries.clear();
+        for (int b = 0; b < lanes; ++b) {
+            const SparseVector& q = *queries[b];
+            for (size_t j = 0; j < q.indices.size(); ++j) {
+                entries.push_back(Entry{q.indices[j], b, (int)j, q.values[j]});
+            }
+        }
+        sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            if (a.dim != b.dim) return a.dim < b.dim;
+            return a.lane != b.lane ? a.lane < b.lane : a.pos < b.pos;
+        });
+        dims.clear();
+        for (const Entry& e : entries) {
+            if (dims.empty() || dims.back() != e.dim) {
+                dims.push_back(e.dim);
+                slot[e.dim] = (int)dims.size();
+            }
+        }
+        values.assign((dims.size() + 1) * lanes, 0.0);
+        for (const Entry& e : entries) values[(size_t)slot[e.dim] * lanes + e.lane] = e.value;
+    }
+
+    // 只清零写过的位置，留给下一块复用
+    void clear() {
+        for (int d : dims) slot[d] = 0;
+        dims.clear();
+        entries.clear();
+    }
+
+    const double* row(int dim) const { return &values[(size_t)slot[dim] * lanes]; }
+};
+
+// 批量计算查询块的哈希码（查询块 × 转置投影矩阵 的一次SpMM）
+// 块内查询按维度归并后，每个维度的投影行只读取一次，累加到所有含该维度的查询上；
+// 每个查询仍按维度升序累加，结果与compute_codes逐位相同
+// codes[q * num_tables + t] 为第q个查询在第t张表的哈希码
+void compute_codes_block(const LSHIndex& index, const QueryBlock& block, vector<double>& acc,
+                         vector<uint32_t>& codes) {
+    int width = index.num_tables * number_hash;
+    acc.assign((size_t)block.lanes * width, 0.0);
+    codes.resize((size_t)block.lanes * index.num_tables);
+    const vector<QueryBlock::Entry>& entries = block.entries;
+    for (size_t i = 0; i < entries.size();) {
+        int dim = entries[i].dim;
+        const double* proj = &index.projections_t[(size_t)dim * width];
+        for (; i < entries.size() && entries[i].dim == dim; ++i) {
+            double* out = &acc[(size_t)entries[i].lane * width];
+            double v = entries[i].value;
+            for (int h = 0; h < width; ++h) {
+                out[h] += v * proj[h];
+            }
+        }
+    }
+    for (int b = 0; b < block.lanes; ++b) {
+        codes_from_projections(index.num_tables, &acc[(size_t)b * width], &codes[(size_t)b * index.num_tables]);
+    }
+}
+
+// 哈希码在Gray码序列中的位置：序列中相邻的两个哈希码只差一位（反过来不成立，翻转一位得到的邻近桶大多不相邻）
+uint32_t gray_rank(uint32_t code) {
+    uint32_t rank = code;
+    for (uint32_t shift = code >> 1; shift; shift >>= 1) rank ^= shift;
+    return rank;
+}
+
+// 多表签名：把能放进64位的各表哈希码拼在一起（5张表×12位=60位），位数超出的表不参与
+// 签名扫描用它作为每个向量的签名，两个签名的Hamming距离就是各表哈希码不同的位数之和；
+// 查询缓存用它作为key的一部分，所有表都放得下时签名唯一确定各表哈希码
+uint64_t pack_signature(const uint32_t* codes, int num_tables) {
+    uint64_t sig = 0;
+    for (int t = 0; t < num_tables && (t + 1) * number_hash <= 64; ++t) {
+        sig |= (uint64_t)codes[t] << (t * number_hash);
+    }
+    return sig;
+}
+
+// 线性扫描计算Hamming距离：dist[i] = popcount(sketches[i] ^ query)
+// 编译时支持AVX-512 VPOPCNTDQ则每次处理8个签名，支持AVX2则用半字节查表每次处理4个，否则逐个popcount
+void hamming_distances(const uint64_t* sketches, size_t n, uint64_t query, uint8_t* dist) {
+    size_t i = 0;
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+    const __m512i q = _mm512_set1_epi64((long long)query);
+    for (; i + 8 <= n; i += 8) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(sketches + i), q);
+        _mm_storel_epi64((__m128i*)(dist + i), _mm512_cvtepi64_epi8(_mm512_popcnt_epi64(x)));
+    }
+#elif defined(__AVX2__)
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i q = _mm256_set1_epi64x((long long)query);
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(sketches + i)), q);
+        __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low)),
+                                        _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+        __m256i sums = _mm256_sad_epu8(bytes, _mm256_setzero_si256());  // 每个64位一个和
+        dist[i] = (uint8_t)_mm256_extract_epi64(sums, 0);
+        dist[i + 1] = (uint8_t)_mm256_extract_epi64(sums, 1);
+        dist[i + 2] = (uint8_t)_mm256_extract_epi64(sums, 2);
+        dist[i + 3] = (uint8_t)_mm256_extract_epi64(sums, 3);
+    }
+#endif
+    for (; i < n; ++i) dist[i] = (uint8_t)__builtin_popcountll(sketches[i] ^ query);
+}
+
+// 把哈希码插入所有表，v为向量的内部id
+void insert_codes(LSHIndex& index, int v, const uint32_t* codes) {
+    for (int t = 0; t < index.num_tables; ++t) {
+        index.hash_tables[t].insert(codes[t], v);
+    }
+}
+
+// 增量构建：计算base中[begin, end)行的哈希码并插入哈希表
+// 重排模式下要等所有向量到齐才能确定顺序，这时只把哈希码追加到codes中，由finish_index统一插入
+void index_rows(LSHIndex& index, int begin, int end, bool reorder, vector<uint32_t>& codes) {
+    size_t offset = reorder ? codes.size() : 0;
+    if (index.sketch_store) index.sketches.reserve(index.row);
+    codes.resize(offset + (size_t)(end - begin) * index.num_tables);
+    vector<double> acc(index.num_tables * number_hash);
+    for (int v = begin; v < end; ++v) {
+        SparseRow r = index.base.row(v);
+        uint32_t* out = &codes[offset + (size_t)(v - begin) * index.num_tables];
+        compute_codes(index, r.indices, r.values, r.nnz, out, acc.data());
+        if (index.sketch_store) index.sketches.push_back(pack_signature(out, index.num_tables));
+        if (!reorder) insert_codes(index, v, out);
+    }
+}
+
+// 计算所有桶的摘要：桶内出现过的每个维度上的取值范围，按桶内取值绝对值的最大值量化成255级
+void compute_bucket_bounds(LSHIndex& index) {
+    vector<double> dim_max(index.col, 0.0), dim_min(index.col, 0.0);
+    vector<char> seen(index.col, 0);
+    vector<int> touched;
+    auto compute = [&](const int* ids, int count, BucketBound& bound, Arena& arena) {
+        touched.clear();
+        double scale = 0.0;
+        for (int i = 0; i < count; ++i) {
+            SparseRow r = index.base.row(ids[i]);
+            for (int j = 0; j < r.nnz; ++j) {
+                int d = r.indices[j];
+                double v = r.values[j];
+                if (!seen[d]) {
+                    seen[d] = 1;
+                    touched.push_back(d);
+                }
+                dim_max[d] = max(dim_max[d], v);
+                dim_min[d] = min(dim_min[d], v);
+                scale = max(scale, fabs(v));
+            }
+        }
+        sort(touched.begin(), touched.end());
+        // step向上调整，保证255*step不小于scale，量化后每一级都不会截断
+        double step = scale / 255;
+        while (step * 255 < scale) step = nextafter(step, HUGE_VAL);
+        int* dims = arena.alloc<int>(touched.size());
+        uint8_t* hi = arena.alloc<uint8_t>(touched.size());
+        uint8_t* lo = arena.alloc<uint8_t>(touched.size());
+        auto quantize = [step](double x) {
+            if (x <= 0) return 0;
+            int q = min(255, (int)ceil(x / step));
+            while (q < 255 && q * step < x) ++q;
+            return q;
+        };
+        for (size_t i = 0; i < touched.size(); ++i) {
+            int d = touched[i];
+            dims[i] = d;
+            hi[i] = (uint8_t)quantize(dim_max[d]);
+            lo[i] = (uint8_t)quantize(-dim_min[d]);
+            dim_max[d] = dim_min[d] = 0.0;
+            seen[d] = 0;
+        }
+        bound.num_dims = (int)touched.size();
+        bound.step = step;
+        bound.dims = dims;
+        bound.hi = hi;
+        bound.lo = lo;
+    };
+    for (auto& table : index.hash_tables) table.attach_bounds(compute);
+}
 
-    // 构建稀疏向量集合
-    vector<SparseVector> sparse_vectors(row);
-    for (int i = 0; i < row; ++i) {
-        for (int j = indptr[i]; j < indptr[i+1]; ++j) {
-            sparse_vectors[i].indices.push_back(indices[j]);
-            sparse_vectors[i].values.push_back(data[j]);
+// 所有向量读完后完成构建
+// reorder为true时先按第一张表哈希码的Gray码顺序重排向量，同一个桶的向量在CSR存储中连续存放
+void finish_index(LSHIndex& index, bool reorder, vector<uint32_t>& codes) {
+    ++index.version;
+    int n = index.base.size();
+    index.external_ids.resize(n);
+    iota(index.external_ids.begin(), index.external_ids.end(), 0);
+    if (reorder) {
+        vector<int>& order = index.external_ids;
+        stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return gray_rank(codes[(size_t)a * index.num_tables]) < gray_rank(codes[(size_t)b * index.num_tables]);
+        });
+        index.base.permute(order);
+        for (int v = 0; v < n; ++v) {
+            insert_codes(index, v, &codes[(size_t)order[v] * index.num_tables]);
+        }
+        if (index.sketch_store) {
+            vector<uint64_t> sketches(n);
+            for (int v = 0; v < n; ++v) sketches[v] = index.sketches[order[v]];
+            index.sketches.swap(sketches);
         }
-        sparse_vectors[i].sort_indices();  // 确保有序
     }
+    index.internal_ids.resize(n);
+    for (int v = 0; v < n; ++v) index.internal_ids[index.external_ids[v]] = v;
+    vector<uint32_t>().swap(codes);
+    for (auto& table : index.hash_tables) table.freeze();
+    if (index.bucket_bounds) compute_bucket_bounds(index);
+}
 
-    // 构建哈希表
-    for (int i = 0; i < num_tables; ++i) {
-        for (int vec_id = 0; vec_id < sparse_vectors.size(); ++vec_id) {
-            auto hash_code = compute_hash(sparse_vectors[vec_id], all_projections[i]);
-            string hash_key;
-            for (bool bit : hash_code) hash_key += (bit ? '1' : '0');
-            hash_tables[i].insert(hash_key, vec_id);
+// 一次性构建：base已经完整读入
+void build_index(LSHIndex& index, bool reorder) {
+    vector<uint32_t> codes;
+    index_rows(index, 0, index.base.size(), reorder, codes);
+    finish_index(index, reorder, codes);
+}
+
+// 查询过滤条件：只在允许的id中检索，和/或返回所有得分不低于阈值的向量（范围查询）
+// 允许集合按内部id存成有序列表；探测时判断用的位图由检索线程的CandidateSet临时置位，
+// 排队中的查询不各占一份 row/8 字节的位图
+struct QueryFilter {
+    bool has_allow = false;
+    vector<int> allow_ids;    // 允许的内部id，升序
+    bool has_threshold = false;
+    double threshold = 0.0;
+
+    // 设置允许集合；ids为内部id，会被排序去重
+    void set_allow(vector<int>& ids) {
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        allow_ids.swap(ids);
+        has_allow = true;
+    }
+
+    void clear() {
+        allow_ids.clear();
+        has_allow = false;
+        has_threshold = false;
+    }
+};
+
+bool is_range(const QueryFilter* filter) {
+    return filter && filter->has_threshold;
+}
+
+// 该得分是否进入结果：范围查询要求不低于阈值，否则只保留正相关结果
+bool keep_score(const QueryFilter* filter, double score) {
+    return is_range(filter) ? score >= filter->threshold : score > 0;
+}
+
+// 候选集：用时间戳标记去重，查询之间复用同一块内存，不需要每次清空标记数组
+// 允许集合的位图也放在这里，每个检索线程一份，所有查询共用
+struct CandidateSet {
+    vector<uint32_t> mark;
+    uint32_t epoch = 0;
+    vector<int> ids;
+    vector<uint64_t> allow_bits;
+    const vector<int>* allow_ids = nullptr;  // 当前置位的允许集合，为空表示不限制
+
+    // 按过滤条件的允许集合置位；用完之后须调用clear_allow，只清除置过的位
+    void set_allow(const QueryFilter* filter, int n) {
+        if (!filter || !filter->has_allow) return;
+        if (allow_bits.size() < (size_t)(n + 63) / 64) allow_bits.assign((n + 63) / 64, 0);
+        for (int id : filter->allow_ids) allow_bits[id >> 6] |= 1ULL << (id & 63);
+        allow_ids = &filter->allow_ids;
+    }
+
+    void clear_allow() {
+        if (!allow_ids) return;
+        for (int id : *allow_ids) allow_bits[id >> 6] = 0;
+        allow_ids = nullptr;
+    }
+
+    bool allowed(int id) const {
+        return !allow_ids || ((allow_bits[id >> 6] >> (id & 63)) & 1);
+    }
+
+    void reset(int n) {
+        if ((int)mark.size() != n) {
+            mark.assign(n, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0) {  // 时间戳回绕
+            fill(mark.begin(), mark.end(), 0);
+            epoch = 1;
         }
+        ids.clear();
+    }
+
+    // 只加入允许集合中的id
+    void insert(const IdList& list) {
+        for (int id : list) {
+            if (mark[id] != epoch && allowed(id)) {
+                mark[id] = epoch;
+                ids.push_back(id);
+            }
+        }
+    }
+
+    size_t size() const { return ids.size(); }
+};
+
+// 批量模式下同一查询块共享的桶查找结果
+// 开放定址表，用时间戳区分查询块，换块时不需要清空，也不为每个桶单独分配节点
+class BucketMemo {
+private:
+    struct Entry {
+        uint64_t key;
+        uint32_t epoch;
+        IdList ids;
+    };
+    vector<Entry> slots;
+    size_t mask = 0;
+    uint32_t epoch = 0;
+
+public:
+    // 开始新的查询块，expected为本块最多查找的桶数
+    void reset(size_t expected) {
+        size_t capacity = 16;
+        while (capacity < 2 * expected) capacity <<= 1;
+        if (capacity > slots.size()) {
+            slots.assign(capacity, Entry{0, 0, IdList{nullptr, 0, nullptr}});
+            mask = capacity - 1;
+            epoch = 0;
+        }
+        if (++epoch == 0) {  // 时间戳回绕
+            for (auto& entry : slots) entry.epoch = 0;
+            epoch = 1;
+        }
+    }
+
+    // 返回key对应的位置；found为false时是新位置，由调用方填入查找结果
+    IdList& lookup(uint64_t key, bool& found) {
+        size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+        while (slots[i].epoch == epoch && slots[i].key != key) i = (i + 1) & mask;
+        found = slots[i].epoch == epoch;
+        slots[i].key = key;
+        slots[i].epoch = epoch;
+        return slots[i].ids;
     }
+};
+
+// 单个桶的查找；memo非空时同一查询块共享桶查找结果
+IdList probe_bucket(const LSHIndex& index, int table_idx, uint32_t code, BucketMemo* memo) {
+    if (!memo) return index.hash_tables[table_idx].find(code);
+    bool found;
+    IdList& ids = memo->lookup(((uint64_t)table_idx << 32) | code, found);
+    if (!found) ids = index.hash_tables[table_idx].find(code);
+    return ids;
+}
+
+// 收集候选集：先查原始桶，再翻转1位查邻近桶，直到候选数达到2*topk
+// 有过滤条件时只有允许的id计入候选
+// 返回true表示候选不足需要回退到全量搜索
+bool collect_candidates(const LSHIndex& index, const uint32_t* codes, int topk, const QueryFilter* filter,
+                        CandidateSet& candidate_ids, BucketMemo* memo) {
+    size_t enough = 2 * (size_t)topk;
+    candidate_ids.reset(index.row);
+    candidate_ids.set_allow(filter, index.row);
+    for (int table_idx = 0; table_idx < index.num_tables; ++table_idx) {
+        uint32_t code = codes[table_idx];
+        // 查找原始桶
+        candidate_ids.insert(probe_bucket(index, table_idx, code, memo));
+
+        // 查找邻近桶（翻转1位）
+        for (int i = 0; i < number_hash && candidate_ids.size() < enough; ++i) {
+            candidate_ids.insert(probe_bucket(index, table_idx, code ^ (1u << i), memo));
+        }
+    }
+    candidate_ids.clear_allow();
+    return candidate_ids.size() == 0 || candidate_ids.size() < topk * 2;
+}
+
+// 一个查询的结果：按得分降序的id及其得分
+struct SearchResult {
+    vector<int> ids;
+    vector<double> scores;
+};
+
+// 选出得分最高的topk个id（得分降序，同分id升序），写入result；topk为负数时输出全部
+void select_topk(vector<pair<double, int>>& scores, int topk, SearchResult& result) {
+    auto cmp = [](const pair<double, int>& a, const pair<double, int>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    int output_size = topk < 0 ? (int)scores.size() : min(topk, (int)scores.size());
+    // 部分排序（更高效）
+    nth_element(scores.begin(), scores.begin() + output_size, scores.end(), cmp);
+    sort(scores.begin(), scores.begin() + output_size, cmp);
+    result.ids.resize(output_size);
+    result.scores.resize(output_size);
+    for (int i = 0; i < output_size; ++i) {
+        result.ids[i] = scores[i].second;
+        result.scores[i] = scores[i].first;
+    }
+}
+
+// 查询内容的FNV-1a哈希（维度、取值、topk和过滤条件），用来区分签名相同的不同查询
+uint64_t content_hash(const SparseVector& query_vec, int topk, const QueryFilter* filter) {
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](uint64_t x) {
+        for (int i = 0; i < 8; ++i) {
+            hash ^= (x >> (i * 8)) & 0xff;
+            hash *= 1099511628211ULL;
+        }
+    };
+    mix((uint64_t)topk);
+    for (size_t i = 0; i < query_vec.indices.size(); ++i) {
+        uint64_t bits;
+        memcpy(&bits, &query_vec.values[i], sizeof(bits));
+        mix((uint64_t)query_vec.indices[i]);
+        mix(bits);
+    }
+    if (filter && filter->has_threshold) {
+        uint64_t bits;
+        memcpy(&bits, &filter->threshold, sizeof(bits));
+        mix(1);
+        mix(bits);
+    }
+    if (filter && filter->has_allow) {
+        mix(2);
+        mix(filter->allow_ids.size());
+        for (int id : filter->allow_ids) mix((uint64_t)id);
+    }
+    return hash;
+}
+
+// 有容量上限的并发缓存：按key分片加锁，分片内用CLOCK算法淘汰
+// 总容量在各分片之间按余数分配，条目总数不超过capacity；容量小于16时减少分片数，每个分片至少一个条目
+template <class K, class V, class KHash = hash<K>>
+class ClockCache {
+private:
+    struct Slot {
+        K key;
+        V value;
+        bool referenced;
+    };
+    struct Shard {
+        mutex lock;
+        vector<Slot> slots;
+        unordered_map<K, size_t, KHash> where;
+        size_t hand = 0;
+        size_t capacity = 0;
+    };
+    static const size_t max_shards = 16;
+    size_t num_shards;
+    vector<Shard> shards;
+    KHash hasher;
+
+    Shard& shard_of(const K& key) {
+        return shards[hasher(key) % num_shards];
+    }
+
+public:
+    atomic<uint64_t> hits, misses;
+
+    ClockCache(size_t capacity)
+        : num_shards(capacity == 0 ? 1 : capacity < max_shards ? capacity : max_shards), shards(num_shards),
+          hits(0), misses(0) {
+        for (size_t i = 0; i < num_shards; ++i) {
+            shards[i].capacity = capacity / num_shards + (i < capacity % num_shards ? 1 : 0);
+        }
+    }
+
+    // 命中时在锁内调用read_value(条目)，由调用方把需要的内容复制到自己的缓冲区
+    template <class F>
+    bool read(const K& key, F read_value) {
+        Shard& shard = shard_of(key);
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.where.find(key);
+        if (it == shard.where.end()) {
+            ++misses;
+            return false;
+        }
+        Slot& slot = shard.slots[it->second];
+        slot.referenced = true;
+        read_value(slot.value);
+        ++hits;
+        return true;
+    }
+
+    bool get(const K& key, V& out) {
+        return read(key, [&out](const V& value) { out = value; });
+    }
+
+    void put(const K& key, const V& value) {
+        Shard& shard = shard_of(key);
+        if (shard.capacity == 0) return;
+        lock_guard<mutex> guard(shard.lock);
+        auto it = shard.where.find(key);
+        if (it != shard.where.end()) {
+            shard.slots[it->second].value = value;
+            shard.slots[it->second].referenced = true;
+            return;
+        }
+        if (shard.slots.size() < shard.capacity) {
+            shard.where[key] = shard.slots.size();
+            shard.slots.push_back(Slot{key, value, false});
+            return;
+        }
+        // CLOCK：跳过最近被访问过的条目（清除其访问位），淘汰第一个未被访问的
+        while (shard.slots[shard.hand].referenced) {
+            shard.slots[shard.hand].referenced = false;
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+        }
+        Slot& victim = shard.slots[shard.hand];
+        shard.where.erase(victim.key);
+        victim.key = key;
+        victim.value = value;
+        shard.where[key] = shard.hand;
+        shard.hand = (shard.hand + 1) % shard.slots.size();
+    }
+
+    void clear() {
+        for (auto& shard : shards) {
+            lock_guard<mutex> guard(shard.lock);
+            shard.slots.clear();
+            shard.where.clear();
+            shard.hand = 0;
+        }
+    }
+};
+
+// 结果缓存的key：多表签名 + 查询内容哈希
+struct ResultKey {
+    uint64_t signature;
+    uint64_t content;
+    bool operator==(const ResultKey& other) const {
+        return signature == other.signature && content == other.content;
+    }
+};
+
+struct ResultKeyHash {
+    size_t operator()(const ResultKey& key) const {
+        return (size_t)(key.signature * 0x9e3779b97f4a7c15ULL ^ key.content);
+    }
+};
+
+// 缓存的候选集（已按内部id排序）；full_scan表示该签名需要回退全量搜索
+struct CachedCandidates {
+    bool full_scan;
+    vector<int> ids;
+};
+
+// 候选集缓存条目的id数上限：每张表的桶按平均大小的4倍计（不少于2*topk）
+// 候选集大小随检索库规模增长，超过上限的候选集不缓存
+size_t max_cached_candidates(int row, int topk, int num_tables) {
+    size_t bucket = ((size_t)row + (1u << number_hash) - 1) >> number_hash;
+    return 4 * (size_t)num_tables * max((size_t)2 * topk, bucket);
+}
+
+// 查询缓存
+// - 结果缓存：签名和内容都相同的重复查询直接返回上次的结果
+// - 候选集缓存：候选集只由各表哈希码决定，签名相同（近似重复）的查询复用候选集，只重新计分
+// 缓存记录建立时的索引版本，索引重建后整体失效
+// 每个条目有大小上限：结果最多topk个（结果更多的范围查询不缓存），候选集最多max_cached_candidates个id，
+// 所以缓存占用的内存不超过add_query_memory的估算
+class QueryCache {
+private:
+    mutex version_lock;
+    uint64_t version = 0;
+
+public:
+    ClockCache<ResultKey, SearchResult, ResultKeyHash> results;
+    ClockCache<uint64_t, CachedCandidates> candidates;
+    bool exact_signature;  // 签名能否唯一确定各表哈希码，决定候选集能否复用
+    size_t max_result_ids;
+    size_t max_candidate_ids;
 
-    // 处理查询
+    QueryCache(size_t capacity, int row, int topk, int num_tables)
+        : results(capacity), candidates(capacity),
+          exact_signature(num_tables * number_hash <= 64),
+          max_result_ids(topk), max_candidate_ids(max_cached_candidates(row, topk, num_tables)) {}
+
+    void put_result(const ResultKey& key, const SearchResult& result) {
+        if (result.ids.size() <= max_result_ids) results.put(key, result);
+    }
+
+    void put_candidates(uint64_t signature, const CachedCandidates& entry) {
+        if (entry.ids.size() <= max_candidate_ids) candidates.put(signature, entry);
+    }
+
+    // 索引版本变化时清空缓存
+    void sync(uint64_t index_version) {
+        lock_guard<mutex> guard(version_lock);
+        if (version == index_version) return;
+        results.clear();
+        candidates.clear();
+        version = index_version;
+    }
+
+    void print_stats(ostream& out) const {
+        out << "cache: result hits " << results.hits << ", misses " << results.misses
+            << "; candidate hits " << candidates.hits << ", misses " << candidates.misses << endl;
+    }
+};
+
+// 获取候选集，结果在candidates.ids中（按内部id排序），优先复用缓存；返回true表示需要回退到全量搜索
+// 有过滤条件的查询候选集还取决于过滤条件，不走候选集缓存
+// 范围查询要返回所有得分不低于阈值的向量，LSH候选集给不出这样的保证，总是回退到全量搜索（有允许集合时只扫描允许的向量）
+bool get_candidates(const LSHIndex& index, const uint32_t* codes, int topk, const QueryFilter* filter,
+                    uint64_t signature, CandidateSet& candidates, BucketMemo* memo, QueryCache* cache) {
+    if (is_range(filter)) {
+        candidates.ids.clear();
+        return true;
+    }
+    bool reuse = cache && cache->exact_signature && !filter;
+    bool cached_full_scan = false;
+    // 命中时复制到candidates.ids已有的缓冲区，不为缓存条目另建副本
+    if (reuse && cache->candidates.read(signature, [&](const CachedCandidates& entry) {
+            candidates.ids.assign(entry.ids.begin(), entry.ids.end());
+            cached_full_scan = entry.full_scan;
+        })) {
+        return cached_full_scan;
+    }
+
+    bool full_scan = collect_candidates(index, codes, topk, filter, candidates, memo);
+    if (full_scan) {
+        candidates.ids.clear();
+    } else {
+        // 按内部id顺序访问候选向量，重排后同一个桶的向量是连续的
+        sort(candidates.ids.begin(), candidates.ids.end());
+    }
+    if (reuse) {
+        CachedCandidates cached;
+        cached.full_scan = full_scan;
+        cached.ids = candidates.ids;
+        cache->put_candidates(signature, cached);
+    }
+    return full_scan;
+}
+
+// 单个查询线程的临时数据：arena每次查询开始时reset，其余缓冲区保留容量
+// 预热之后逐条查询不再申请堆内存（写入查询缓存的新条目除外）；批量模式的对应数据见BatchScratch
+struct QueryScratch {
+    Arena arena;
+    CandidateSet candidates;
+    vector<pair<double, int>> scores;
+    vector<uint8_t> distances;
+    vector<pair<int, int>> ties;  // 签名扫描中距离恰好为截断距离的向量：(原始id, 内部id)
+
+    QueryScratch() : arena(16 << 10) {}
+};
+
+// 逐条查询，结果写入result；filter为空表示不过滤的top-k查询
+void search_one(const LSHIndex& index, const SparseVector& query_vec, int topk, const QueryFilter* filter,
+                QueryScratch& scratch, QueryCache* cache, SearchResult& result) {
+    scratch.arena.reset();
+    uint32_t* codes = scratch.arena.alloc<uint32_t>(index.num_tables);
+    double* acc = scratch.arena.alloc<double>(index.num_tables * number_hash);
+    compute_codes(index, query_vec.indices.data(), query_vec.values.data(), query_vec.indices.size(), codes, acc);
+
+    // 重复查询直接返回缓存结果
+    uint64_t signature = pack_signature(codes, index.num_tables);
+    ResultKey key = {signature, 0};
+    if (cache) {
+        cache->sync(index.version);
+        key.content = content_hash(query_vec, topk, filter);
+        if (cache->results.get(key, result)) return;
+    }
+
+    // 获取候选集；候选集不足时回退到全量搜索，有允许集合时只扫描允许的向量
+    bool full_scan = get_candidates(index, codes, topk, filter, signature, scratch.candidates, nullptr, cache);
+    const int* ids = scratch.candidates.ids.data();
+    int n = full_scan ? index.row : (int)scratch.candidates.size();
+    if (full_scan && filter && filter->has_allow) {
+        full_scan = false;
+        ids = filter->allow_ids.data();
+        n = (int)filter->allow_ids.size();
+    }
+
+    // 计算得分
+    vector<pair<double, int>>& scores = scratch.scores;
+    scores.clear();
+    for (int i = 0; i < n; ++i) {
+        int id = full_scan ? i : ids[i];
+        if (i + 1 < n) {
+            SparseRow next = index.base.row(full_scan ? i + 1 : ids[i + 1]);
+            __builtin_prefetch(next.indices);
+            __builtin_prefetch(next.values);
+        }
+        double score = sparse_inner_product(query_vec, index.base.row(id));
+        if (keep_score(filter, score)) {
+            scores.emplace_back(score, index.external_ids[id]);
+        }
+    }
+    select_topk(scores, is_range(filter) ? -1 : topk, result);
+    if (cache) cache->put_result(key, result);
+}
+
+// 查询与桶内任意向量内积的上界；dense为按维度展开的查询（不在查询中的维度为0）
+double bucket_upper_bound(const double* dense, const BucketBound& bound) {
+    double sum = 0.0;
+    for (int i = 0; i < bound.num_dims; ++i) {
+        double q = dense[bound.dims[i]];
+        sum += q > 0 ? q * bound.hi[i] : -q * bound.lo[i];
+    }
+    return sum * bound.step;
+}
+
+// 一次探测：cost为翻转位投影值的平方和，越小越可能包含近邻
+struct Probe {
+    double cost;
+    int table;
+    uint32_t code;
+    bool operator<(const Probe& other) const {
+        if (cost != other.cost) return cost < other.cost;
+        if (table != other.table) return table < other.table;
+        return code < other.code;
+    }
+};
+
+// 按扰动顺序生成探测序列：各表的原始桶，翻转一位，以及投影值最接近0的几位两两翻转
+// acc为compute_codes得到的投影值；max_probes大于0时只保留扰动最小的max_probes个
+void make_probes(const LSHIndex& index, const uint32_t* codes, const double* acc, int max_probes,
+                 vector<Probe>& probes) {
+    const int pair_bits = 6;
+    probes.clear();
+    for (int t = 0; t < index.num_tables; ++t) {
+        const double* margin = acc + t * number_hash;
+        int order[number_hash];
+        iota(order, order + number_hash, 0);
+        sort(order, order + number_hash, [margin](int a, int b) { return fabs(margin[a]) < fabs(margin[b]); });
+        probes.push_back(Probe{0.0, t, codes[t]});
+        for (int i = 0; i < number_hash; ++i) {
+            int b = order[i];
+            probes.push_back(Probe{margin[b] * margin[b], t, codes[t] ^ (1u << b)});
+        }
+        for (int i = 0; i < min(pair_bits, number_hash); ++i) {
+            for (int j = 0; j < i; ++j) {
+                int a = order[i], b = order[j];
+                probes.push_back(Probe{margin[a] * margin[a] + margin[b] * margin[b], t,
+                                       codes[t] ^ (1u << a) ^ (1u << b)});
+            }
+        }
+    }
+    size_t kept = max_probes > 0 ? min(probes.size(), (size_t)max_probes) : probes.size();
+    partial_sort(probes.begin(), probes.begin() + kept, probes.end());
+    probes.resize(kept);
+}
+
+// 上界剪枝探测需要的临时数据
+struct BoundScratch {
+    vector<double> dense;                      // 按维度展开的查询，查询结束时只清零写过的位置
+    vector<Probe> probes;
+    vector<pair<double, int>> heap;            // 当前top-k，堆顶为第k名
+    vector<pair<double, IdList>> buckets;      // 待访问的桶及其上界
+};
+
+// 上界剪枝探测：按扰动顺序生成各表要探测的桶，按桶的内积上界从大到小访问，
+// 上界（乘以bound_scale）低于当前第k名得分时停止，剩下的桶上界更低，不可能再有更好的结果
+// 探测完仍不足k个结果时，按上界从大到小扫描第一张表的所有桶（每个向量恰好在其中一个桶里），
+// 上界低于第k名时停止；bound_scale为1时这一步得到的是精确的top-k
+// 范围查询以阈值代替第k名得分剪枝，有允许集合的查询只访问允许的向量，这两类查询总是做第二步，结果是精确的；
+// 允许集合不超过第一张表的桶数时，第二步改为直接对未访问过的允许向量计分，比逐桶计算上界更省
+void search_bounded(const LSHIndex& index, const SparseVector& query_vec, int topk, const QueryFilter* filter,
+                    const Options& opt, QueryScratch& scratch, BoundScratch& bscratch, QueryCache* cache,
+                    SearchResult& result) {
+    scratch.arena.reset();
+    uint32_t* codes = scratch.arena.alloc<uint32_t>(index.num_tables);
+    double* acc = scratch.arena.alloc<double>(index.num_tables * number_hash);
+    compute_codes(index, query_vec.indices.data(), query_vec.values.data(), query_vec.indices.size(), codes, acc);
+
+    ResultKey key = {pack_signature(codes, index.num_tables), 0};
+    if (cache) {
+        cache->sync(index.version);
+        key.content = content_hash(query_vec, topk, filter);
+        if (cache->results.get(key, result)) return;
+    }
+
+    bool range = is_range(filter);
+    auto better = [](const pair<double, int>& a, const pair<double, int>& b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    };
+    vector<pair<double, int>>& heap = bscratch.heap;
+    heap.clear();
+    CandidateSet& visited = scratch.candidates;
+    visited.reset(index.row);
+    visited.set_allow(filter, index.row);
+    vector<pair<double, int>>& scores = scratch.scores;  // 范围查询的结果直接放这里
+    scores.clear();
+
+    // 是否可以跳过上界为ub的桶（只保留正相关结果，所以上界不超过0的桶总是跳过）
+    auto prune = [&](double ub) {
+        if (range) return (ub > 0 ? opt.bound_scale * ub : ub) < filter->threshold;
+        if (ub <= 0) return true;
+        return (int)heap.size() >= topk && opt.bound_scale * ub < heap.front().first;
+    };
+    auto score_one = [&](int id) {
+        double score = sparse_inner_product(query_vec, index.base.row(id));
+        if (!keep_score(filter, score)) return;
+        pair<double, int> item(score, index.external_ids[id]);
+        if (range) {
+            scores.push_back(item);
+        } else if ((int)heap.size() < topk) {
+            heap.push_back(item);
+            push_heap(heap.begin(), heap.end(), better);
+        } else if (better(item, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = item;
+            push_heap(heap.begin(), heap.end(), better);
+        }
+    };
+    auto visit = [&](const IdList& list) {
+        for (int i = 0; i < list.count; ++i) {
+            int id = list.ids[i];
+            if (visited.mark[id] == visited.epoch || !visited.allowed(id)) continue;
+            visited.mark[id] = visited.epoch;
+            if (i + 1 < list.count) {
+                SparseRow next = index.base.row(list.ids[i + 1]);
+                __builtin_prefetch(next.indices);
+                __builtin_prefetch(next.values);
+            }
+            score_one(id);
+        }
+    };
+
+    vector<double>& dense = bscratch.dense;
+    if ((int)dense.size() < index.col) dense.assign(index.col, 0.0);
+    for (size_t i = 0; i < query_vec.indices.size(); ++i) dense[query_vec.indices[i]] = query_vec.values[i];
+    auto by_bound = [](const pair<double, IdList>& a, const pair<double, IdList>& b) { return a.first > b.first; };
+    vector<pair<double, IdList>>& buckets = bscratch.buckets;
+
+    make_probes(index, codes, acc, opt.max_probes, bscratch.probes);
+    buckets.clear();
+    for (const Probe& probe : bscratch.probes) {
+        IdList list = index.hash_tables[probe.table].find(probe.code);
+        if (list.count) buckets.emplace_back(bucket_upper_bound(dense.data(), *list.bound), list);
+    }
+    stable_sort(buckets.begin(), buckets.end(), by_bound);  // 上界相同的桶保持扰动顺序
+    for (const auto& bucket : buckets) {
+        if (prune(bucket.first)) break;
+        visit(bucket.second);
+    }
+
+    bool allow = filter && filter->has_allow;
+    if (allow && filter->allow_ids.size() <= index.hash_tables[0].num_buckets()) {
+        for (int id : filter->allow_ids) {
+            if (visited.mark[id] != visited.epoch) score_one(id);
+        }
+    } else if (range || allow || (int)heap.size() < topk) {
+        buckets.clear();
+        index.hash_tables[0].for_each_bucket([&](const IdList& list) {
+            buckets.emplace_back(bucket_upper_bound(dense.data(), *list.bound), list);
+        });
+        stable_sort(buckets.begin(), buckets.end(), by_bound);
+        for (const auto& bucket : buckets) {
+            if (prune(bucket.first)) break;
+            visit(bucket.second);
+        }
+    }
+    for (int d : query_vec.indices) dense[d] = 0.0;
+    visited.clear_allow();
+
+    if (!range) scores.assign(heap.begin(), heap.end());
+    select_topk(scores, range ? -1 : topk, result);
+    if (cache) cache->put_result(key, result);
+}
+
+// 签名扫描：顺序扫描所有向量的64位签名，按与查询签名的Hamming距离取最近的若干个候选，再精确计分
+// 不依赖桶是否命中，也不需要全量内积回退；有允许集合时只对允许的向量排序
+// 范围查询不取候选，对所有（允许的）向量计分，结果是精确的
+void search_sketch(const LSHIndex& index, const SparseVector& query_vec, int topk, const QueryFilter* filter,
+                   const Options& opt, QueryScratch& scratch, QueryCache* cache, SearchResult& result) {
+    scratch.arena.reset();
+    uint32_t* codes = scratch.arena.alloc<uint32_t>(index.num_tables);
+    double* acc = scratch.arena.alloc<double>(index.num_tables * number_hash);
+    compute_codes(index, query_vec.indices.data(), query_vec.values.data(), query_vec.indices.size(), codes, acc);
+
+    ResultKey key = {pack_signature(codes, index.num_tables), 0};
+    if (cache) {
+        cache->sync(index.version);
+        key.content = content_hash(query_vec, topk, filter);
+        if (cache->results.get(key, result)) return;
+    }
+
+    // 有允许集合时dist[i]对应allow_ids[i]，否则对应内部id i
+    const int* allow = filter && filter->has_allow ? filter->allow_ids.data() : nullptr;
+    int n = allow ? (int)filter->allow_ids.size() : index.row;
+    uint64_t query_sketch = key.signature;
+    vector<uint8_t>& dist = scratch.distances;
+    dist.resize(n);
+    if (allow) {
+        for (int i = 0; i < n; ++i) dist[i] = __builtin_popcountll(index.sketches[allow[i]] ^ query_sketch);
+    } else {
+        hamming_distances(index.sketches.data(), n, query_sketch, dist.data());
+    }
+
+    // 按距离计数，找到第want个候选所在的距离
+    int want = is_range(filter) ? n : min(n, opt.sketch_candidates > 0 ? opt.sketch_candidates : 20 * topk);
+    int count[65] = {0};
+    for (int i = 0; i < n; ++i) ++count[dist[i]];
+    int cutoff = 0, below = 0;
+    while (cutoff < 64 && below + count[cutoff] < want) below += count[cutoff++];
+    int at_cutoff = want - below;  // 距离恰好为cutoff的向量取原始id最小的at_cutoff个，与是否重排无关
+
+    vector<pair<double, int>>& scores = scratch.scores;
+    vector<pair<int, int>>& ties = scratch.ties;
+    scores.clear();
+    ties.clear();
+    auto score_one = [&](int id) {
+        double score = sparse_inner_product(query_vec, index.base.row(id));
+        if (keep_score(filter, score)) {
+            scores.emplace_back(score, index.external_ids[id]);
+        }
+    };
+    for (int i = 0; i < n; ++i) {
+        if (dist[i] > cutoff) continue;
+        int id = allow ? allow[i] : i;
+        if (dist[i] == cutoff) {
+            ties.emplace_back(index.external_ids[id], id);
+        } else {
+            score_one(id);
+        }
+    }
+    if ((int)ties.size() > at_cutoff) {
+        nth_element(ties.begin(), ties.begin() + at_cutoff, ties.end());
+        ties.resize(at_cutoff);
+        sort(ties.begin(), ties.end(), [](const pair<int, int>& a, const pair<int, int>& b) { return a.second < b.second; });
+    }
+    for (const auto& tie : ties) score_one(tie.second);
+    select_topk(scores, is_range(filter) ? -1 : topk, result);
+    if (cache) cache->put_result(key, result);
+}
+
+// 批量查询的复用缓冲区，查询块之间不重新分配；预热之后处理查询块不再申请堆内存（写入查询缓存的新条目除外）
+struct BatchScratch {
+    QueryBlock block;
+    vector<uint32_t> codes;
+    vector<ResultKey> keys;
+    vector<char> cached;                       // 命中结果缓存的查询
+    vector<vector<pair<double, int>>> scores;  // 每个查询的得分
+    vector<pair<int, int>> hits;               // (候选id, 块内查询号)
+    vector<int> full_scan;                     // 需要回退全量搜索的查询
+    vector<int> lanes;                         // 当前候选向量要计算的查询
+    vector<double> acc;
+    CandidateSet candidates;
+    BucketMemo memo;
+};
+
+// 批量查询：处理一块查询，结果写入results中对应的位置；filters[b]为空表示第b个查询不过滤
+// 1. 块内查询按维度归并成稀疏查询块，一次SpMM算出整块查询在所有表的哈希码
+// 2. 块内共享桶查找，按候选id把查询分组（倒排成 候选id -> 查询列表）
+// 3. 候选向量按id顺序读取一次，按其非零元从查询块取行，同时得到它对所有命中查询的得分；
+//    回退全量搜索的查询合并成一次全库扫描，每个向量只读一次
+void search_batch(const LSHIndex& index, const vector<const SparseVector*>& queries, int topk,
+                  const vector<const QueryFilter*>& filters, BatchScratch& scratch, QueryCache* cache,
+                  const vector<SearchResult*>& results) {
+    int nb = (int)queries.size();
+    QueryBlock& block = scratch.block;
+    block.load(queries, index.col);
+    vector<uint32_t>& codes = scratch.codes;
+    compute_codes_block(index, block, scratch.acc, codes);
+
+    // 收集候选并倒排；命中结果缓存的查询不参与计分
+    vector<ResultKey>& keys = scratch.keys;
+    vector<char>& cached = scratch.cached;
+    keys.assign(nb, ResultKey{0, 0});
+    cached.assign(nb, 0);
+    vector<pair<int, int>>& hits = scratch.hits;
+    vector<int>& full_scan = scratch.full_scan;
+    hits.clear();
+    full_scan.clear();
+    scratch.memo.reset((size_t)nb * index.num_tables * (number_hash + 1));
+    if (cache) cache->sync(index.version);
+    for (int b = 0; b < nb; ++b) {
+        const uint32_t* query_codes = &codes[(size_t)b * index.num_tables];
+        keys[b].signature = pack_signature(query_codes, index.num_tables);
+        if (cache) {
+            keys[b].content = content_hash(*queries[b], topk, filters[b]);
+            if (cache->results.get(keys[b], *results[b])) {
+                cached[b] = 1;
+                continue;
+            }
+        }
+        if (get_candidates(index, query_codes, topk, filters[b], keys[b].signature, scratch.candidates,
+                           &scratch.memo, cache)) {
+            // 有允许集合的查询回退时只需要扫描允许的向量
+            if (filters[b] && filters[b]->has_allow) {
+                for (int id : filters[b]->allow_ids) hits.emplace_back(id, b);
+            } else {
+                full_scan.push_back(b);
+            }
+            continue;
+        }
+        for (int id : scratch.candidates.ids) hits.emplace_back(id, b);
+    }
+    sort(hits.begin(), hits.end());
+
+    vector<vector<pair<double, int>>>& scores = scratch.scores;
+    if ((int)scores.size() < nb) scores.resize(nb);
+    for (int b = 0; b < nb; ++b) scores[b].clear();
+    vector<int>& lanes = scratch.lanes;
+    vector<double>& acc = scratch.acc;
+    const int* slot = block.slot.data();
+    const double* qvals = block.values.data();
+    size_t h = 0;
+    // 按id顺序扫描候选向量；有回退查询时扫描全部向量
+    int limit = full_scan.empty() ? 0 : index.row;
+    for (int id = 0; id < limit || h < hits.size(); ++id) {
+        if (id >= limit) id = hits[h].first;
+        lanes.assign(full_scan.begin(), full_scan.end());
+        for (; h < hits.size() && hits[h].first == id; ++h) lanes.push_back(hits[h].second);
+        if (lanes.empty()) continue;
+        int next = id + 1 < limit ? id + 1 : h < hits.size() ? hits[h].first : -1;
+        if (next >= 0) {
+            SparseRow r = index.base.row(next);
+            __builtin_prefetch(r.indices);
+            __builtin_prefetch(r.values);
+        }
+
+        // 与双指针内积相同，按维度升序累加，不在查询中的维度取到的是0
+        int nl = (int)lanes.size();
+        SparseRow vec = index.base.row(id);
+        acc.assign(nl, 0.0);
+        if (nl == 1) {
+            const double* column = qvals + lanes[0];
+            double sum = 0.0;
+            for (int j = 0; j < vec.nnz; ++j) sum += vec.values[j] * column[(size_t)slot[vec.indices[j]] * nb];
+            acc[0] = sum;
+        } else {
+            for (int j = 0; j < vec.nnz; ++j) {
+                const double* qd = qvals + (size_t)slot[vec.indices[j]] * nb;
+                double v = vec.values[j];
+                for (int l = 0; l < nl; ++l) {
+                    acc[l] += v * qd[lanes[l]];
+                }
+            }
+        }
+        for (int l = 0; l < nl; ++l) {
+            const QueryFilter* filter = filters[lanes[l]];
+            if (keep_score(filter, acc[l])) scores[lanes[l]].emplace_back(acc[l], index.external_ids[id]);
+        }
+    }
+    block.clear();
+
+    for (int b = 0; b < nb; ++b) {
+        if (cached[b]) continue;
+        select_topk(scores[b], is_range(filters[b]) ? -1 : topk, *results[b]);
+        if (cache) cache->put_result(keys[b], *results[b]);
+    }
+}
+
+// 输入格式
+enum InputFormat {
+    INPUT_CSR,     // 文本CSR：indptr、indices、data三个数组依次给出
+    INPUT_ROWS,    // 文本逐行：每个向量一组 "nnz / 维度 / 取值"，与查询格式相同
+    INPUT_BINARY   // 二进制逐行，见read_header
+};
+
+// 输入读取：用fread大块读入缓冲区后再解析，文本和二进制格式共用
+class InputReader {
+private:
+    FILE* file;
+    vector<char> buffer;
+    size_t pos = 0, len = 0;
+
+    bool fill() {
+        if (pos < len) return true;
+        len = fread(buffer.data(), 1, buffer.size(), file);
+        pos = 0;
+        return len > 0;
+    }
+
+    bool skip_spaces() {
+        while (fill()) {
+            while (pos < len && isspace((unsigned char)buffer[pos])) ++pos;
+            if (pos < len) return true;
+        }
+        return false;
+    }
+
+    // 读出下一个以空白分隔的词
+    bool read_token(char* token, size_t cap) {
+        if (!skip_spaces()) return false;
+        size_t n = 0;
+        while (fill() && !isspace((unsigned char)buffer[pos])) {
+            if (n + 1 < cap) token[n++] = buffer[pos];
+            ++pos;
+        }
+        token[n] = '\0';
+        return n > 0;
+    }
+
+public:
+    explicit InputReader(FILE* f, size_t size = 1 << 20) : file(f), buffer(size) {}
+
+    template <class T>
+    bool read_int(T& x) {
+        if (!skip_spaces()) return false;
+        bool negative = buffer[pos] == '-';
+        if (negative || buffer[pos] == '+') ++pos;
+        long long value = 0;
+        bool any = false;
+        while (fill() && buffer[pos] >= '0' && buffer[pos] <= '9') {
+            value = value * 10 + (buffer[pos] - '0');
+            ++pos;
+            any = true;
+        }
+        x = (T)(negative ? -value : value);
+        return any;
+    }
+
+    bool read_double(double& x) {
+        char token[64];
+        if (!read_token(token, sizeof(token))) return false;
+        char* end;
+        x = strtod(token, &end);
+        return *end == '\0';
+    }
+
+    bool read_bytes(void* out, size_t n) {
+        char* dst = static_cast<char*>(out);
+        while (n > 0) {
+            if (!fill()) return false;
+            size_t take = min(n, len - pos);
+            memcpy(dst, buffer.data() + pos, take);
+            pos += take;
+            dst += take;
+            n -= take;
+        }
+        return true;
+    }
+
+    template <class T>
+    bool read_binary(T& x) {
+        return read_bytes(&x, sizeof(T));
+    }
+};
+
+// 数据头：row col nnz topk
+// 二进制格式以 "LSHB" 开头，随后依次为 int32 row, int32 col, int64 nnz, int32 topk
+bool read_header(InputReader& in, InputFormat format, int& row, int& col, size_t& nnz, int& topk) {
+    if (format != INPUT_BINARY) {
+        return in.read_int(row) && in.read_int(col) && in.read_int(nnz) && in.read_int(topk);
+    }
+    char magic[4];
+    int64_t nnz64;
+    if (!in.read_bytes(magic, 4) || memcmp(magic, "LSHB", 4) != 0) return false;
+    if (!in.read_binary(row) || !in.read_binary(col) || !in.read_binary(nnz64) || !in.read_binary(topk)) return false;
+    nnz = (size_t)nnz64;
+    return true;
+}
+
+// 逐行格式的一个向量
+// 文本：nnz，然后nnz个维度，再nnz个取值
+// 二进制：int32 nnz，int32 维度[nnz]，float64 取值[nnz]
+bool read_row_size(InputReader& in, InputFormat format, int& k) {
+    bool ok = format == INPUT_BINARY ? in.read_binary(k) : in.read_int(k);
+    return ok && k >= 0;
+}
+
+// 读取一个向量的k个维度和k个取值到调用方提供的数组
+bool read_row_body(InputReader& in, InputFormat format, int k, int* indices, double* values) {
+    if (format == INPUT_BINARY) {
+        return in.read_bytes(indices, k * sizeof(int)) && in.read_bytes(values, k * sizeof(double));
+    }
+    for (int i = 0; i < k; i++) {
+        if (!in.read_int(indices[i])) return false;
+    }
+    for (int i = 0; i < k; i++) {
+        if (!in.read_double(values[i])) return false;
+    }
+    return true;
+}
+
+// 读取一个向量，追加到indices/values末尾
+bool read_row(InputReader& in, InputFormat format, vector<int>& indices, vector<double>& values) {
+    int k;
+    if (!read_row_size(in, format, k)) return false;
+    size_t start = indices.size();
+    indices.resize(start + k);
+    values.resize(start + k);
+    return read_row_body(in, format, k, indices.data() + start, values.data() + start);
+}
+
+// 读取一个查询的过滤条件，ids为读入允许id用的临时数组
+// 文本：threshold m，然后m个允许的id；二进制：float64 threshold，int32 m，int32 id[m]
+// threshold为nan表示不限阈值（top-k查询），m为-1表示不限id；超出范围的id忽略
+bool read_filter(InputReader& in, InputFormat format, const LSHIndex& index, QueryFilter& filter, vector<int>& ids) {
+    double threshold;
+    int m;
+    filter.clear();
+    if (format == INPUT_BINARY) {
+        if (!in.read_binary(threshold) || !in.read_binary(m) || m < -1) return false;
+    } else {
+        if (!in.read_double(threshold) || !in.read_int(m) || m < -1) return false;
+    }
+    if (threshold == threshold) {
+        filter.has_threshold = true;
+        filter.threshold = threshold;
+    }
+    if (m < 0) return true;
+    ids.resize(m);
+    if (format == INPUT_BINARY) {
+        if (!in.read_bytes(ids.data(), m * sizeof(int))) return false;
+    } else {
+        for (int i = 0; i < m; ++i) {
+            if (!in.read_int(ids[i])) return false;
+        }
+    }
+    // 转换成内部id
+    size_t kept = 0;
+    for (int id : ids) {
+        if (id >= 0 && id < index.row) ids[kept++] = index.internal_ids[id];
+    }
+    ids.resize(kept);
+    filter.set_allow(ids);
+    return true;
+}
+
+// 文本CSR格式：整个数据集读完之后才能构建
+bool load_csr(InputReader& in, LSHIndex& index, size_t nnz, bool reorder) {
+    CSRStore& base = index.base;
+    base.indptr.resize(index.row + 1);
+    for (int i = 0; i <= index.row; i++) {
+        if (!in.read_int(base.indptr[i])) return false;
+    }
+    base.indices.resize(nnz);
+    for (size_t i = 0; i < nnz; i++) {
+        if (!in.read_int(base.indices[i])) return false;
+    }
+    base.values.resize(nnz);
+    for (size_t i = 0; i < nnz; i++) {
+        if (!in.read_double(base.values[i])) return false;
+    }
+    base.sort_rows();  // 确保有序
+    build_index(index, reorder);
+    return true;
+}
+
+// 逐行格式的流水线构建：读取线程把向量直接解析到按nnz分配好的CSR存储中，每读完chunk_rows行通知一次，
+// 当前线程同时对已读入的行排序、计算哈希码并插入哈希表；不经过中间缓冲区，峰值内存与一次性读入CSR相同
+// 头部的nnz是非零元总数的上限，实际更多时报错，更少时多余的部分不使用
+bool stream_build(InputReader& in, InputFormat format, LSHIndex& index, size_t nnz,
+                  bool reorder, int chunk_rows) {
+    CSRStore& base = index.base;
+    base.indptr.assign(index.row + 1, 0);
+    base.indices.resize(nnz);
+    base.values.resize(nnz);
+
+    mutex lock;
+    condition_variable progress;
+    int rows_read = 0;  // 已读入的行数：这些行的indptr和数据不再被读取线程修改
+    bool done = false, read_ok = true;
+    thread reader([&] {
+        size_t used = 0;
+        int r = 0;
+        bool ok = true;
+        for (; r < index.row; ++r) {
+            int k;
+            if (!read_row_size(in, format, k) || (size_t)k > nnz - used
+                || !read_row_body(in, format, k, base.indices.data() + used, base.values.data() + used)) {
+                ok = false;
+                break;
+            }
+            used += k;
+            base.indptr[r + 1] = used;
+            if ((r + 1) % chunk_rows == 0) {
+                lock_guard<mutex> guard(lock);
+                rows_read = r + 1;
+                progress.notify_one();
+            }
+        }
+        lock_guard<mutex> guard(lock);
+        rows_read = r;
+        read_ok = ok;
+        done = true;
+        progress.notify_one();
+    });
+
+    vector<uint32_t> codes;
+    vector<pair<int, double>> paired;
+    int begin = 0;
+    bool finished = false;
+    while (!finished) {
+        int end;
+        {
+            unique_lock<mutex> guard(lock);
+            progress.wait(guard, [&] { return rows_read > begin || done; });
+            end = rows_read;
+            finished = done;
+        }
+        for (int i = begin; i < end; ++i) base.sort_row(i, paired);
+        index_rows(index, begin, end, reorder, codes);
+        begin = end;
+    }
+    reader.join();
+    if (!read_ok) return false;
+    base.indices.resize(base.indptr[index.row]);
+    base.values.resize(base.indptr[index.row]);
+    finish_index(index, reorder, codes);
+    return true;
+}
+
+// 有界无锁队列（单生产者单消费者环形缓冲区）：查询流水线相邻两个阶段之间传递任务
+// 队列空或满时让出CPU等待
+template <class T>
+class SpscQueue {
+private:
+    vector<T> ring;
+    size_t mask;
+    atomic<size_t> head;  // 下一个出队位置，只由消费者修改
+    atomic<size_t> tail;  // 下一个入队位置，只由生产者修改
+
+public:
+    explicit SpscQueue(size_t min_capacity) : head(0), tail(0) {
+        size_t capacity = 1;
+        while (capacity < min_capacity) capacity <<= 1;
+        ring.resize(capacity);
+        mask = capacity - 1;
+    }
+
+    void push(const T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        while (t - head.load(memory_order_acquire) > mask) this_thread::yield();
+        ring[t & mask] = item;
+        tail.store(t + 1, memory_order_release);
+    }
+
+    T pop() {
+        size_t h = head.load(memory_order_relaxed);
+        while (tail.load(memory_order_acquire) == h) this_thread::yield();
+        T item = ring[h & mask];
+        head.store(h + 1, memory_order_release);
+        return item;
+    }
+};
+
+// 输出格式
+enum OutputFormat {
+    OUTPUT_TEXT,   // 每个查询一行，空格分隔的id
+    OUTPUT_BINARY  // "LSHR"，int32 nq；每个查询 int32 k，int32 ids[k]，float64 scores[k]
+};
+
+// 可复用的输出缓冲区：结果先写入缓冲区，攒满后一次fwrite，不再每个查询刷新一次
+class OutputBuffer {
+private:
+    vector<char> data;
+    size_t used = 0;
+    FILE* file;
+
+public:
+    explicit OutputBuffer(FILE* f, size_t size = 1 << 20) : data(size), file(f) {}
+
+    ~OutputBuffer() { flush(); }
+
+    void flush() {
+        if (used) fwrite(data.data(), 1, used, file);
+        used = 0;
+        fflush(file);
+    }
+
+    void reserve(size_t n) {
+        if (used + n > data.size()) {
+            if (used) fwrite(data.data(), 1, used, file);
+            used = 0;
+            if (n > data.size()) data.resize(n);
+        }
+    }
+
+    void put_bytes(const void* bytes, size_t n) {
+        reserve(n);
+        memcpy(data.data() + used, bytes, n);
+        used += n;
+    }
+
+    void put_char(char c) {
+        reserve(1);
+        data[used++] = c;
+    }
+
+    void put_int(int x) {
+        char digits[16];
+        int n = 0;
+        unsigned int v = x < 0 ? 0u - (unsigned int)x : (unsigned int)x;
+        do {
+            digits[n++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v);
+        reserve(n + 1);
+        if (x < 0) data[used++] = '-';
+        while (n) data[used++] = digits[--n];
+    }
+
+    template <class T>
+    void put_binary(const T& x) {
+        put_bytes(&x, sizeof(T));
+    }
+};
+
+// 输出能否回写：管道不能定位；追加模式下写入总是落在文件末尾，也不能回写；非POSIX平台一律不回写
+bool seekable_output(FILE* file) {
+#if defined(__unix__) || defined(__APPLE__)
+    int flags = fcntl(fileno(file), F_GETFL);
+    return flags >= 0 && !(flags & O_APPEND) && ftell(file) >= 0;
+#else
+    (void)file;
+    return false;
+#endif
+}
+
+void write_result(OutputBuffer& out, OutputFormat format, const SearchResult& result) {
+    if (format == OUTPUT_BINARY) {
+        int k = (int)result.ids.size();
+        out.put_binary(k);
+        out.put_bytes(result.ids.data(), k * sizeof(int));
+        out.put_bytes(result.scores.data(), k * sizeof(double));
+        return;
+    }
+    for (size_t i = 0; i < result.ids.size(); ++i) {
+        if (i != 0) out.put_char(' ');
+        out.put_int(result.ids[i]);
+    }
+    out.put_char('\n');
+}
+
+// 查询任务：在解析、检索、输出三个阶段之间流转，用完回到空闲队列循环复用
+struct QueryJob {
+    SparseVector query;
+    QueryFilter filter;
+    SearchResult result;
+};
+
+// 查询流水线：解析线程 -> 检索（当前线程）-> 输出线程，三段之间用无锁队列连接
+// 返回false表示查询数据不完整（已解析的查询照常输出）
+bool run_query_pipeline(InputReader& in, InputFormat in_format, OutputFormat out_format,
+                        const LSHIndex& index, int topk, const Options& opt, QueryCache* cache) {
     int nq;
-    cin >> nq;
-    vector<Query> queries(nq);
-    for (int q = 0; q < nq; q++) {
-        int q_nnz;
-        cin >> q_nnz;
-        queries[q].ids.resize(q_nnz);
-        queries[q].vals.resize(q_nnz);
-        for (int i = 0; i < q_nnz; i++) cin >> queries[q].ids[i];
-        for (int i = 0; i < q_nnz; i++) cin >> queries[q].vals[i];
-    }
-
-    for (const auto& query : queries) {
-        // 构建查询向量
-        SparseVector query_vec;
-        query_vec.indices = query.ids;
-        query_vec.values = query.vals;
-        query_vec.sort_indices();
-
-        // 获取候选集
-        unordered_set<int> candidate_ids;
-        for (int table_idx = 0; table_idx < num_tables; ++table_idx) {
-            auto hash_code = compute_hash(query_vec, all_projections[table_idx]);
-            string hash_key;
-            for (bool b : hash_code) hash_key += (b ? '1' : '0');
-            
-            // 查找原始桶
-            vector<int> direct_candidates = hash_tables[table_idx].find(hash_key);
-            candidate_ids.insert(direct_candidates.begin(), direct_candidates.end());
-            
-            // 查找邻近桶（翻转1位）
-            for (int i = 0; i < hash_key.size() && candidate_ids.size() < 2 * topk; ++i) {
-                string neighbor = hash_key;
-                neighbor[i] = (neighbor[i] == '1') ? '0' : '1';
-                vector<int> neighbor_candidates = hash_tables[table_idx].find(neighbor);
-                candidate_ids.insert(neighbor_candidates.begin(), neighbor_candidates.end());
+    if (!(in_format == INPUT_BINARY ? in.read_binary(nq) : in.read_int(nq)) || nq < 0) return false;
+    InputFormat row_format = in_format == INPUT_BINARY ? INPUT_BINARY : INPUT_ROWS;
+
+    // 批量模式下检索阶段最多同时持有一整块任务，任务池要比块大
+    size_t pool_size = (opt.batch ? opt.batch_size : 1) + 64;
+    vector<QueryJob> pool(pool_size);
+    SpscQueue<QueryJob*> free_jobs(pool_size), parsed(pool_size), searched(pool_size);
+    for (auto& job : pool) free_jobs.push(&job);
+
+    bool parse_ok = true;
+    thread parser([&] {
+        vector<int> ids;
+        vector<pair<int, double>> paired;
+        for (int q = 0; q < nq; ++q) {
+            QueryJob* job = free_jobs.pop();
+            job->query.indices.clear();
+            job->query.values.clear();
+            if ((opt.filtered && !read_filter(in, row_format, index, job->filter, ids))
+                || !read_row(in, row_format, job->query.indices, job->query.values)) {
+                // 出错的任务不再使用，不放回空闲队列：空闲队列只能由输出线程入队（单生产者）
+                parse_ok = false;
+                break;
             }
+            job->query.sort_indices(paired);
+            parsed.push(job);
         }
+        parsed.push(nullptr);  // 结束标记
+    });
 
-        // 候选集不足时回退到全量搜索
-        if (candidate_ids.empty() || candidate_ids.size() < topk * 2) {
-            for (int i = 0; i < row; ++i) candidate_ids.insert(i);
+    thread emitter([&] {
+        OutputBuffer out(stdout);
+        long start = seekable_output(stdout) ? ftell(stdout) : -1;
+        if (out_format == OUTPUT_BINARY) {
+            out.put_bytes("LSHR", 4);
+            out.put_binary(nq);
+        }
+        int written = 0;
+        while (QueryJob* job = searched.pop()) {
+            write_result(out, out_format, job->result);
+            free_jobs.push(job);
+            ++written;
+        }
+        out.flush();
+        // 输入不完整时实际输出的结果比头部的nq少：输出是文件就回写实际条数，否则读取方应以文件结束为准
+        if (out_format == OUTPUT_BINARY && written != nq && start >= 0
+            && fseek(stdout, start + 4, SEEK_SET) == 0) {
+            fwrite(&written, sizeof(written), 1, stdout);
+            fseek(stdout, 0, SEEK_END);
+            fflush(stdout);
         }
+    });
 
-        // 计算得分
-        vector<pair<double, int>> scores;
-        for (int id : candidate_ids) {
-            double score = sparse_inner_product(query_vec, sparse_vectors[id]);
-            if (score > 0) {  // 只保留正相关结果
-                scores.emplace_back(score, id);
+    if (opt.batch) {
+        BatchScratch scratch;
+        vector<QueryJob*> block;
+        vector<const SparseVector*> queries;
+        vector<const QueryFilter*> filters;
+        vector<SearchResult*> results;
+        bool done = false;
+        while (!done) {
+            block.clear();
+            while ((int)block.size() < opt.batch_size) {
+                QueryJob* job = parsed.pop();
+                if (!job) {
+                    done = true;
+                    break;
+                }
+                block.push_back(job);
             }
+            if (block.empty()) break;
+            queries.clear();
+            filters.clear();
+            results.clear();
+            for (QueryJob* job : block) {
+                queries.push_back(&job->query);
+                filters.push_back(opt.filtered ? &job->filter : nullptr);
+                results.push_back(&job->result);
+            }
+            search_batch(index, queries, topk, filters, scratch, cache, results);
+            for (QueryJob* job : block) searched.push(job);
+        }
+    } else {
+        QueryScratch scratch;
+        BoundScratch bscratch;
+        while (QueryJob* job = parsed.pop()) {
+            const QueryFilter* filter = opt.filtered ? &job->filter : nullptr;
+            if (opt.probe == PROBE_BOUND) {
+                search_bounded(index, job->query, topk, filter, opt, scratch, bscratch, cache, job->result);
+            } else if (opt.probe == PROBE_SKETCH) {
+                search_sketch(index, job->query, topk, filter, opt, scratch, cache, job->result);
+            } else {
+                search_one(index, job->query, topk, filter, scratch, cache, job->result);
+            }
+            searched.push(job);
+        }
+    }
+    searched.push(nullptr);
+
+    parser.join();
+    emitter.join();
+    return parse_ok;
+}
+
+// 各数据结构占用的字节数
+struct MemoryReport {
+    vector<pair<string, size_t>> items;
+
+    void add(const string& name, size_t bytes) { items.emplace_back(name, bytes); }
+
+    size_t total() const {
+        size_t sum = 0;
+        for (const auto& item : items) sum += item.second;
+        return sum;
+    }
+
+    void print(ostream& out, const string& title) const {
+        out << title << ":" << endl;
+        for (const auto& item : items) {
+            out << "  " << item.first << ": " << item.second << " bytes" << endl;
         }
+        out << "  total: " << total() << " bytes" << endl;
+    }
+};
 
-        // 部分排序（更高效）
-        nth_element(scores.begin(), scores.begin() + min(topk, (int)scores.size()), scores.end(),
-            [](const pair<double, int>& a, const pair<double, int>& b) {
-                return a.first > b.first || (a.first == b.first && a.second < b.second);
-            });
+// 查询缓存和每个查询线程临时数据的估算
+// 缓存条目按大小上限计：结果条目topk个id和得分，候选集条目max_cached_candidates个id；
+// 每个条目另加约128字节的槽位、哈希表节点和vector头
+void add_query_memory(MemoryReport& report, int row, int topk, int num_tables, const Options& opt) {
+    size_t result_bytes = 128 + (size_t)topk * (sizeof(int) + sizeof(double));
+    size_t candidate_bytes = 128 + max_cached_candidates(row, topk, num_tables) * sizeof(int);
+    report.add("query cache (bound)", (size_t)opt.cache_size * (result_bytes + candidate_bytes));
+    report.add("query scratch (estimated)", (size_t)row * (sizeof(uint32_t) + sizeof(int) + sizeof(pair<double, int>)));
+    // 允许集合的位图每个检索线程只有一份，排队中的查询只保存有序id列表
+    if (opt.filtered) report.add("allow bitmap", (size_t)(row + 63) / 64 * sizeof(uint64_t));
+}
 
-        // 输出结果
-        int output_size = min(topk, (int)scores.size());
-        for (int i = 0; i < output_size; ++i) {
-            if (i != 0) cout << " ";
-            cout << scores[i].second;
+// 读入数据之前按规模估算内存
+MemoryReport estimate_memory(int row, int col, size_t nnz, int topk, int num_tables, const Options& opt) {
+    MemoryReport report;
+    size_t csr_bytes = (size_t)(row + 1) * sizeof(size_t) + nnz * (sizeof(int) + sizeof(double));
+    report.add("base csr", csr_bytes);
+    report.add("projections", (size_t)num_tables * number_hash * col * sizeof(double));
+    size_t buckets = (size_t)1 << number_hash;
+    size_t nodes = min((size_t)row, buckets);
+    report.add("hash tables", num_tables * MyHashTable::estimate_bytes(buckets, nodes, row));
+    // 桶摘要按每个非零元各占一个维度计（上限），实际同一个桶内重复的维度只记一次
+    if (opt.probe == PROBE_BOUND) {
+        report.add("bucket bounds", num_tables * (nodes * sizeof(BucketBound) + nnz * (sizeof(int) + 2)));
+    }
+    if (opt.probe == PROBE_SKETCH) report.add("sketches", (size_t)row * sizeof(uint64_t));
+    report.add("external ids", 2 * (size_t)row * sizeof(int));
+    // 构建期间的峰值：转置前的一张表的投影向量；各表增长中的id数组；重排时还有所有向量的哈希码和CSR副本
+    size_t build_bytes = (size_t)number_hash * col * sizeof(double) + 2 * (size_t)row * num_tables * sizeof(int);
+    if (opt.reorder) build_bytes += (size_t)row * num_tables * sizeof(uint32_t) + csr_bytes;
+    report.add("build scratch (peak)", build_bytes);
+    add_query_memory(report, row, topk, num_tables, opt);
+    return report;
+}
+
+// 构建完成后实际占用的内存
+MemoryReport measure_memory(const LSHIndex& index, int topk, const Options& opt) {
+    MemoryReport report;
+    const CSRStore& base = index.base;
+    report.add("base csr", base.indptr.capacity() * sizeof(size_t) + base.indices.capacity() * sizeof(int)
+                           + base.values.capacity() * sizeof(double));
+    report.add("projections", index.projections_t.capacity() * sizeof(double));
+    size_t table_bytes = 0;
+    for (const auto& table : index.hash_tables) table_bytes += table.memory_bytes();
+    report.add("hash tables", table_bytes);
+    report.add("external ids", (index.external_ids.capacity() + index.internal_ids.capacity()) * sizeof(int));
+    if (index.sketch_store) report.add("sketches", index.sketches.capacity() * sizeof(uint64_t));
+    add_query_memory(report, index.row, topk, index.num_tables, opt);
+    return report;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_options(argc, argv, opt)) return 1;
+
+    InputFormat format = opt.input == "rows" ? INPUT_ROWS : opt.input == "binary" ? INPUT_BINARY : INPUT_CSR;
+    InputReader in(stdin);
+    int row, col, topk;
+    size_t nnz;
+    if (!read_header(in, format, row, col, nnz, topk)) {
+        cerr << "invalid input header" << endl;
+        return 1;
+    }
+
+    LSHIndex index;
+    index.row = row;
+    index.col = col;
+    index.num_tables = 5;  // 增加哈希表数量提高召回率
+    index.bucket_bounds = opt.probe == PROBE_BOUND;
+    index.sketch_store = opt.probe == PROBE_SKETCH;
+
+    // 超出内存预算的配置直接拒绝
+    if (opt.mem_budget > 0) {
+        MemoryReport estimate = estimate_memory(row, col, nnz, topk, index.num_tables, opt);
+        if (estimate.total() > opt.mem_budget) {
+            estimate.print(cerr, "estimated memory");
+            cerr << "estimated memory exceeds budget of " << opt.mem_budget << " bytes" << endl;
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < index.num_tables; ++i) {
+        index.hash_tables.emplace_back(1 << number_hash);
+    }
+    init_projections(index);
+
+    // 读取稀疏矩阵数据并构建哈希表
+    bool loaded = format == INPUT_CSR ? load_csr(in, index, nnz, opt.reorder)
+                                      : stream_build(in, format, index, nnz, opt.reorder, opt.chunk_rows);
+    if (!loaded) {
+        cerr << "unexpected end of base vectors" << endl;
+        return 1;
+    }
+
+    if (opt.mem_budget > 0 || opt.mem_report) {
+        MemoryReport usage = measure_memory(index, topk, opt);
+        usage.print(cerr, "memory");
+        if (opt.mem_budget > 0 && usage.total() > opt.mem_budget) {
+            cerr << "memory exceeds budget of " << opt.mem_budget << " bytes" << endl;
+            return 1;
         }
-        cout << endl;
+    }
+
+    QueryCache* cache = nullptr;
+    if (opt.cache_size > 0) cache = new QueryCache(opt.cache_size, index.row, topk, index.num_tables);
+
+    // 边读边查边输出
+    OutputFormat out_format = opt.binary_output ? OUTPUT_BINARY : OUTPUT_TEXT;
+    bool queries_ok = run_query_pipeline(in, format, out_format, index, topk, opt, cache);
+
+    if (cache) {
+        cache->print_stats(cerr);
+        delete cache;
+    }
+    if (!queries_ok) {
+        cerr << "unexpected end of queries" << endl;
+        return 1;
     }
     return 0;
 }
@@ -234,4 +234,5 @@ int main() {
         }
         cout << endl;
     }
+    return 0;
 }
@@ -0,0 +1,594 @@
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+using namespace std;
+
+// 图索引版本：在检索库上建分层近邻图（HNSW），用内积作为相似度
+// 每个向量是一个节点，第0层每个节点最多2*M个邻居，更高层最多M个；
+// 查询从最高层的入口点贪心下降，在第0层做宽度为ef的最佳优先搜索，不需要全量回退
+
+// 稀疏向量结构
+struct SparseVector {
+    vector<int> indices;
+    vector<double> values;
+};
+
+// 稀疏行视图：指向CSR存储中的一行
+struct SparseRow {
+    const int* indices;
+    const double* values;
+    int nnz;
+};
+
+// 检索库的CSR存储：所有向量的非零元连续存放
+struct CSRStore {
+    vector<size_t> indptr;
+    vector<int> indices;
+    vector<double> values;
+
+    int size() const { return (int)indptr.size() - 1; }
+
+    SparseRow row(int i) const {
+        SparseRow r;
+        r.indices = indices.data() + indptr[i];
+        r.values = values.data() + indptr[i];
+        r.nnz = (int)(indptr[i + 1] - indptr[i]);
+        return r;
+    }
+};
+
+// 稠密展开的查询：展开一次之后，与每个向量的内积只需遍历该向量的非零元，不要求维度有序
+// 搜索时同一个查询要和成千上万个节点计分，比双指针内积更快
+class DenseQuery {
+private:
+    vector<double> dense;
+    SparseRow query = {nullptr, nullptr, 0};
+
+public:
+    void load(const SparseRow& q, int col) {
+        if ((int)dense.size() < col) dense.resize(col, 0.0);
+        query = q;
+        for (int i = 0; i < q.nnz; ++i) dense[q.indices[i]] += q.values[i];
+    }
+
+    // 只清零写过的位置，留给下一个查询复用
+    void clear() {
+        for (int i = 0; i < query.nnz; ++i) dense[query.indices[i]] = 0.0;
+        query.nnz = 0;
+    }
+
+    double score(const SparseRow& v) const {
+        double result = 0.0;
+        for (int i = 0; i < v.nnz; ++i) result += dense[v.indices[i]] * v.values[i];
+        return result;
+    }
+};
+
+// 已访问节点：用时间戳标记，搜索之间不需要清空
+struct VisitedSet {
+    vector<uint32_t> mark;
+    uint32_t epoch = 0;
+
+    void reset(int n) {
+        if ((int)mark.size() < n) mark.assign(n, 0);
+        if (++epoch == 0) {  // 时间戳回绕时清零一次
+            fill(mark.begin(), mark.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    // 返回true表示第一次访问
+    bool visit(int id) {
+        if (mark[id] == epoch) return false;
+        mark[id] = epoch;
+        return true;
+    }
+};
+
+// 运行参数
+struct Options {
+    int M = 16;                 // 高层每个节点的邻居数，第0层为2*M
+    int ef_construction = 200;  // 建图时的搜索宽度
+    int ef = 0;                 // 查询时的搜索宽度，0表示 max(64, topk)
+    int threads = 0;            // 建图线程数，0表示CPU核数
+};
+
+bool parse_options(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--M=", 4) == 0) {
+            opt.M = atoi(argv[i] + 4);
+            if (opt.M < 2) {
+                cerr << "invalid M: " << argv[i] + 4 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--ef-construction=", 18) == 0) {
+            opt.ef_construction = atoi(argv[i] + 18);
+            if (opt.ef_construction <= 0) {
+                cerr << "invalid ef-construction: " << argv[i] + 18 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--ef=", 5) == 0) {
+            opt.ef = atoi(argv[i] + 5);
+            if (opt.ef <= 0) {
+                cerr << "invalid ef: " << argv[i] + 5 << endl;
+                return false;
+            }
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            opt.threads = atoi(argv[i] + 10);
+            if (opt.threads <= 0) {
+                cerr << "invalid thread count: " << argv[i] + 10 << endl;
+                return false;
+            }
+        } else {
+            cerr << "unknown option: " << argv[i] << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// 分层近邻图
+// 邻居表的第一个元素是邻居数，后面是邻居id；第0层的邻居表连续存放在links0中，高层的按节点分别存放
+struct GraphIndex {
+    int row = 0, col = 0;
+    int M = 16, max_m0 = 32, ef_construction = 200;
+    CSRStore base;
+    vector<int> levels;          // 每个节点所在的最高层
+    vector<int> links0;          // [节点][1 + max_m0]
+    vector<vector<int>> upper;   // [节点][(层-1) * (1 + M)]
+    unique_ptr<mutex[]> locks;   // 建图时保护每个节点的邻居表
+    mutex entry_lock;            // 保护入口点和最高层
+    int entry = -1, max_level = -1;
+    bool building = false;       // 建图期间读邻居表要加锁
+
+    int* links(int node, int level) {
+        if (level == 0) return &links0[(size_t)node * (1 + max_m0)];
+        return &upper[node][(size_t)(level - 1) * (1 + M)];
+    }
+
+    const int* links(int node, int level) const {
+        return const_cast<GraphIndex*>(this)->links(node, level);
+    }
+
+    int max_links(int level) const { return level == 0 ? max_m0 : M; }
+};
+
+// 每个线程的搜索临时数据，建图和查询共用
+struct SearchScratch {
+    DenseQuery query;
+    DenseQuery expanded;                   // 选邻居时展开的检索库向量
+    VisitedSet visited;
+    vector<pair<double, int>> candidates;  // 待扩展的节点，堆顶为得分最高
+    vector<pair<double, int>> results;     // 当前最好的ef个节点，堆顶为得分最低
+    vector<int> neighbors;                 // 邻居表的副本
+    vector<pair<double, int>> selected;
+    vector<pair<double, int>> pruned;
+};
+
+// 得分降序，同分id升序
+bool better(const pair<double, int>& a, const pair<double, int>& b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+bool worse(const pair<double, int>& a, const pair<double, int>& b) {
+    return better(b, a);
+}
+
+// 复制节点在某层的邻居表；建图期间别的线程可能同时在改，需要加锁
+void copy_links(const GraphIndex& index, int node, int level, vector<int>& out) {
+    unique_lock<mutex> guard;
+    if (index.building) guard = unique_lock<mutex>(index.locks[node]);
+    const int* list = index.links(node, level);
+    out.assign(list + 1, list + 1 + list[0]);
+}
+
+// 在某一层做最佳优先搜索：scratch.results中为入口点（已标记访问），结束后为得分最高的ef个节点
+void search_layer(const GraphIndex& index, int level, int ef, SearchScratch& scratch) {
+    vector<pair<double, int>>& candidates = scratch.candidates;
+    vector<pair<double, int>>& results = scratch.results;
+    candidates.assign(results.begin(), results.end());
+    make_heap(candidates.begin(), candidates.end(), worse);
+    make_heap(results.begin(), results.end(), better);
+    while ((int)results.size() > ef) {
+        pop_heap(results.begin(), results.end(), better);
+        results.pop_back();
+    }
+
+    while (!candidates.empty()) {
+        pair<double, int> current = candidates.front();
+        // 最好的候选也不如当前第ef名时停止
+        if ((int)results.size() >= ef && current.first < results.front().first) break;
+        pop_heap(candidates.begin(), candidates.end(), worse);
+        candidates.pop_back();
+
+        copy_links(index, current.second, level, scratch.neighbors);
+        const vector<int>& neighbors = scratch.neighbors;
+        for (size_t i = 0; i < neighbors.size(); ++i) {
+            int id = neighbors[i];
+            if (!scratch.visited.visit(id)) continue;
+            if (i + 1 < neighbors.size()) {
+                SparseRow next = index.base.row(neighbors[i + 1]);
+                __builtin_prefetch(next.indices);
+                __builtin_prefetch(next.values);
+            }
+            pair<double, int> item(scratch.query.score(index.base.row(id)), id);
+            if ((int)results.size() < ef || better(item, results.front())) {
+                candidates.push_back(item);
+                push_heap(candidates.begin(), candidates.end(), worse);
+                results.push_back(item);
+                push_heap(results.begin(), results.end(), better);
+                if ((int)results.size() > ef) {
+                    pop_heap(results.begin(), results.end(), better);
+                    results.pop_back();
+                }
+            }
+        }
+    }
+}
+
+// 从入口点开始逐层下降到target_level，scratch.results中为下降到的节点
+void descend(const GraphIndex& index, int entry, int top_level, int target_level, SearchScratch& scratch) {
+    scratch.results.assign(1, make_pair(scratch.query.score(index.base.row(entry)), entry));
+    for (int level = top_level; level > target_level; --level) {
+        scratch.visited.reset(index.row);
+        scratch.visited.visit(scratch.results[0].second);
+        search_layer(index, level, 1, scratch);
+    }
+}
+
+// 启发式选邻居：candidates按得分降序，候选c与查询的内积不低于它与已选中每个邻居的内积时才选中，
+// 让邻居分布在不同方向上；选不满m个时再按得分补上被跳过的候选
+void select_neighbors(const GraphIndex& index, const vector<pair<double, int>>& candidates, int m,
+                      SearchScratch& scratch) {
+    vector<pair<double, int>>& selected = scratch.selected;
+    vector<pair<double, int>>& pruned = scratch.pruned;
+    selected.clear();
+    pruned.clear();
+    for (const auto& c : candidates) {
+        if ((int)selected.size() >= m) break;
+        bool keep = true;
+        if (!selected.empty()) {
+            scratch.expanded.load(index.base.row(c.second), index.col);
+            for (const auto& s : selected) {
+                if (scratch.expanded.score(index.base.row(s.second)) > c.first) {
+                    keep = false;
+                    break;
+                }
+            }
+            scratch.expanded.clear();
+        }
+        (keep ? selected : pruned).push_back(c);
+    }
+    for (size_t i = 0; i < pruned.size() && (int)selected.size() < m; ++i) selected.push_back(pruned[i]);
+}
+
+// 把新节点id加入邻居node在某层的邻居表；邻居表已满时在原邻居和新节点中保留得分最高的几个
+// 这样会挤掉得分低的反向边，个别节点因此没有入边，由建图之后的repair_reachability补上
+// （溢出时改用启发式筛选也能保住大部分反向边，但建图慢一倍，ef较小时召回反而更低）
+void connect(GraphIndex& index, int node, int id, double score, int level, SearchScratch& scratch) {
+    lock_guard<mutex> guard(index.locks[node]);
+    int* list = index.links(node, level);
+    int cap = index.max_links(level);
+    if (list[0] < cap) {
+        list[1 + list[0]++] = id;
+        return;
+    }
+    vector<pair<double, int>>& candidates = scratch.pruned;
+    candidates.assign(1, make_pair(score, id));
+    scratch.expanded.load(index.base.row(node), index.col);
+    for (int i = 1; i <= list[0]; ++i) {
+        candidates.emplace_back(scratch.expanded.score(index.base.row(list[i])), list[i]);
+    }
+    scratch.expanded.clear();
+    nth_element(candidates.begin(), candidates.begin() + cap, candidates.end(), better);
+    for (int i = 0; i < cap; ++i) list[1 + i] = candidates[i].second;
+}
+
+// 插入一个节点：先从入口点下降到该节点的最高层，再逐层搜索ef_construction个近邻并互相连接
+void insert_node(GraphIndex& index, int id, SearchScratch& scratch) {
+    int level = index.levels[id];
+    // 新节点层数超过当前最高层时整个插入过程持有入口锁，完成后成为新的入口点
+    unique_lock<mutex> entry_guard(index.entry_lock);
+    int entry = index.entry, max_level = index.max_level;
+    if (level <= max_level) entry_guard.unlock();
+
+    if (entry >= 0) {
+        scratch.query.load(index.base.row(id), index.col);
+        descend(index, entry, max_level, level, scratch);
+        for (int l = min(level, max_level); l >= 0; --l) {
+            scratch.visited.reset(index.row);
+            for (const auto& r : scratch.results) scratch.visited.visit(r.second);
+            search_layer(index, l, index.ef_construction, scratch);
+
+            vector<pair<double, int>> found(scratch.results);
+            sort(found.begin(), found.end(), better);
+            select_neighbors(index, found, index.M, scratch);
+            vector<pair<double, int>> neighbors(scratch.selected);
+            {
+                lock_guard<mutex> guard(index.locks[id]);
+                int* list = index.links(id, l);
+                list[0] = (int)neighbors.size();
+                for (size_t i = 0; i < neighbors.size(); ++i) list[1 + i] = neighbors[i].second;
+            }
+            for (const auto& n : neighbors) connect(index, n.second, id, n.first, l, scratch);
+            scratch.results.swap(found);  // 本层的结果作为下一层的入口
+        }
+        scratch.query.clear();
+    }
+
+    if (level > max_level) {
+        index.entry = id;
+        index.max_level = level;
+    }
+}
+
+// 第0层从start出发能走到的节点，标记在reached中
+void mark_reachable(const GraphIndex& index, int start, vector<char>& reached, vector<int>& stack) {
+    if (reached[start]) return;
+    reached[start] = 1;
+    stack.assign(1, start);
+    while (!stack.empty()) {
+        const int* list = index.links(stack.back(), 0);
+        stack.pop_back();
+        for (int i = 1; i <= list[0]; ++i) {
+            if (!reached[list[i]]) {
+                reached[list[i]] = 1;
+                stack.push_back(list[i]);
+            }
+        }
+    }
+}
+
+// 建图后修补第0层的连通性：从入口点出发走不到的节点，在走得到的部分里搜索离它最近的节点，
+// 挂到第一个邻居表还有空位的节点上；都满了就替换得分最高的那个节点里入边最多的一个邻居。
+// 替换可能让别的节点失去唯一的入边，所以修补之后重新检查，直到所有节点都走得到。
+// 查询时第0层的搜索也从入口点出发，ef不小于向量数时搜索会访问所有节点，结果是精确的
+void repair_reachability(GraphIndex& index, SearchScratch& scratch) {
+    int n = index.row;
+    vector<int> in_degree(n, 0);
+    for (int u = 0; u < n; ++u) {
+        const int* list = index.links(u, 0);
+        for (int i = 1; i <= list[0]; ++i) ++in_degree[list[i]];
+    }
+    vector<char> reached(n);
+    vector<int> stack;
+    for (int round = 0; round < 16; ++round) {
+        fill(reached.begin(), reached.end(), 0);
+        mark_reachable(index, index.entry, reached, stack);
+        bool complete = true;
+        for (int v = 0; v < n; ++v) {
+            if (reached[v]) continue;
+            complete = false;
+            scratch.query.load(index.base.row(v), index.col);
+            scratch.results.assign(1, make_pair(scratch.query.score(index.base.row(index.entry)), index.entry));
+            scratch.visited.reset(n);
+            scratch.visited.visit(index.entry);
+            search_layer(index, 0, index.ef_construction, scratch);
+            scratch.query.clear();
+            sort(scratch.results.begin(), scratch.results.end(), better);
+
+            int host = scratch.results[0].second;
+            for (const auto& r : scratch.results) {
+                if (index.links(r.second, 0)[0] < index.max_m0) {
+                    host = r.second;
+                    break;
+                }
+            }
+            int* list = index.links(host, 0);
+            if (list[0] < index.max_m0) {
+                list[1 + list[0]++] = v;
+            } else {
+                int slot = 1;
+                for (int i = 2; i <= list[0]; ++i) {
+                    if (in_degree[list[i]] > in_degree[list[slot]]) slot = i;
+                }
+                --in_degree[list[slot]];
+                list[slot] = v;
+            }
+            ++in_degree[v];
+            mark_reachable(index, v, reached, stack);
+        }
+        if (complete) break;
+    }
+}
+
+// 建图：层数按 floor(-ln(U)/ln(M)) 抽取（固定种子），多个线程并行插入节点
+void build_graph(GraphIndex& index, int threads) {
+    int n = index.row;
+    index.max_m0 = 2 * index.M;
+    index.levels.resize(n);
+    mt19937 gen(42);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    double level_mult = 1.0 / log((double)index.M);
+    for (int i = 0; i < n; ++i) {
+        index.levels[i] = min(16, (int)(-log(1.0 - uniform(gen)) * level_mult));
+    }
+    index.links0.assign((size_t)n * (1 + index.max_m0), 0);
+    index.upper.resize(n);
+    for (int i = 0; i < n; ++i) {
+        if (index.levels[i] > 0) index.upper[i].assign((size_t)index.levels[i] * (1 + index.M), 0);
+    }
+    index.locks.reset(new mutex[max(n, 1)]);
+    if (n == 0) return;
+
+    index.building = true;
+    SearchScratch first;
+    insert_node(index, 0, first);
+    atomic<int> next(1);
+    auto worker = [&] {
+        SearchScratch scratch;
+        for (int id = next++; id < n; id = next++) insert_node(index, id, scratch);
+    };
+    vector<thread> pool;
+    for (int t = 1; t < threads; ++t) pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool) t.join();
+    index.building = false;
+    repair_reachability(index, first);
+}
+
+// 查询：下降到第0层后做宽度为ef的搜索，取得分最高的topk个（只保留正相关结果）
+void search(const GraphIndex& index, const SparseVector& query_vec, int topk, int ef, SearchScratch& scratch,
+            vector<pair<double, int>>& out) {
+    out.clear();
+    if (index.entry < 0) return;
+    SparseRow q = {query_vec.indices.data(), query_vec.values.data(), (int)query_vec.indices.size()};
+    scratch.query.load(q, index.col);
+    descend(index, index.entry, index.max_level, 0, scratch);
+    scratch.visited.reset(index.row);
+    scratch.visited.visit(scratch.results[0].second);
+    // 入口点也作为第0层的起点，保证所有节点都在搜索范围内（见repair_reachability）
+    if (scratch.visited.visit(index.entry)) {
+        scratch.results.emplace_back(scratch.query.score(index.base.row(index.entry)), index.entry);
+    }
+    search_layer(index, 0, max(ef, topk), scratch);
+    scratch.query.clear();
+
+    for (const auto& r : scratch.results) {
+        if (r.first > 0) out.push_back(r);
+    }
+    int output_size = min(topk, (int)out.size());
+    partial_sort(out.begin(), out.begin() + output_size, out.end(), better);
+    out.resize(output_size);
+}
+
+// 基于fread的输入读取
+class InputReader {
+private:
+    FILE* file;
+    vector<char> buffer;
+    size_t pos = 0, len = 0;
+
+    bool fill() {
+        if (pos < len) return true;
+        len = fread(buffer.data(), 1, buffer.size(), file);
+        pos = 0;
+        return len > 0;
+    }
+
+    bool skip_spaces() {
+        while (fill()) {
+            while (pos < len && isspace((unsigned char)buffer[pos])) ++pos;
+            if (pos < len) return true;
+        }
+        return false;
+    }
+
+public:
+    explicit InputReader(FILE* f, size_t size = 1 << 20) : file(f), buffer(size) {}
+
+    template <class T>
+    bool read_int(T& x) {
+        if (!skip_spaces()) return false;
+        bool negative = buffer[pos] == '-';
+        if (negative || buffer[pos] == '+') ++pos;
+        long long value = 0;
+        bool any = false;
+        while (fill() && buffer[pos] >= '0' && buffer[pos] <= '9') {
+            value = value * 10 + (buffer[pos] - '0');
+            ++pos;
+            any = true;
+        }
+        x = (T)(negative ? -value : value);
+        return any;
+    }
+
+    bool read_double(double& x) {
+        if (!skip_spaces()) return false;
+        char token[64];
+        size_t n = 0;
+        while (fill() && !isspace((unsigned char)buffer[pos])) {
+            if (n + 1 < sizeof(token)) token[n++] = buffer[pos];
+            ++pos;
+        }
+        token[n] = '\0';
+        char* end;
+        x = strtod(token, &end);
+        return n > 0 && *end == '\0';
+    }
+};
+
+int main(int argc, char** argv) {
+    Options opt;
+    if (!parse_options(argc, argv, opt)) return 1;
+
+    /* 输入数据 */
+    InputReader in(stdin);
+    int row, col, topk;
+    size_t nnz;
+    if (!in.read_int(row) || !in.read_int(col) || !in.read_int(nnz) || !in.read_int(topk)) {
+        cerr << "invalid input header" << endl;
+        return 1;
+    }
+
+    GraphIndex index;
+    index.row = row;
+    index.col = col;
+    index.M = opt.M;
+    index.ef_construction = opt.ef_construction;
+    CSRStore& base = index.base;
+    base.indptr.resize(row + 1);
+    base.indices.resize(nnz);
+    base.values.resize(nnz);
+    bool ok = true;
+    for (int i = 0; i <= row && ok; i++) ok = in.read_int(base.indptr[i]);
+    for (size_t i = 0; i < nnz && ok; i++) ok = in.read_int(base.indices[i]);
+    for (size_t i = 0; i < nnz && ok; i++) ok = in.read_double(base.values[i]);
+    if (!ok) {
+        cerr << "unexpected end of base vectors" << endl;
+        return 1;
+    }
+
+    /* 建图 */
+    int threads = opt.threads > 0 ? opt.threads : max(1u, thread::hardware_concurrency());
+    build_graph(index, threads);
+
+    /* 处理查询 */
+    int nq;
+    if (!in.read_int(nq)) nq = 0;
+    int ef = opt.ef > 0 ? opt.ef : max(64, topk);
+    SearchScratch scratch;
+    SparseVector query_vec;
+    vector<pair<double, int>> result;
+    string out;
+    for (int q = 0; q < nq; ++q) {
+        int k;
+        if (!in.read_int(k) || k < 0) {
+            cerr << "unexpected end of queries" << endl;
+            return 1;
+        }
+        query_vec.indices.resize(k);
+        query_vec.values.resize(k);
+        for (int i = 0; i < k && ok; i++) ok = in.read_int(query_vec.indices[i]);
+        for (int i = 0; i < k && ok; i++) ok = in.read_double(query_vec.values[i]);
+        if (!ok) {
+            cerr << "unexpected end of queries" << endl;
+            return 1;
+        }
+
+        search(index, query_vec, topk, ef, scratch, result);
+        for (size_t i = 0; i < result.size(); ++i) {
+            if (i != 0) out += ' ';
+            out += to_string(result[i].second);
+        }
+        out += '\n';
+        if (out.size() > (1 << 20)) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}